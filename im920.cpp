@@ -17,10 +17,19 @@
 #define IM920_PACKET_FLAG_MASK		(0x18)
 #define IM920_PACKET_FLAG_MASK_FRAG	(0x10)
 #define IM920_PACKET_FLAG_MASK_ACK	(0x08)
+#define IM920_PACKET_FLAG_MASK_TOPIC	(0x20)
+#define IM920_PACKET_FLAG_MASK_DICT	(0x40)
+#define IM920_PACKET_FEC_I			1
+#define IM920_PACKET_FEC_MASK		(0xE0)
+#define IM920_PACKET_FEC_SHIFT		5
 #define IM920_PACKET_TYPE_I			1
 #define IM920_PACKET_TYPE_MASK		(0x07)
 #define IM920_PACKET_FRAMEID_I		2
-#define IM920_PACKET_PAYLOAD_I		IM920_PACKET_HEADER_SIZE
+#define IM920_PACKET_VERSION_I		0
+#define IM920_PACKET_VERSION_MASK	(0xC0)
+#define IM920_PACKET_VERSION_SHIFT	6
+#define IM920_PACKET_SEQHIGH_I		3
+#define IM920_PACKET_STREAM_I		4
 
 #define IM920_PACKET_ACK_CMD_I		0
 #define IM920_PACKET_ACK_PARAM_I	1
@@ -37,14 +46,157 @@
 #define STRING_DATA_MAX_LENGTH	(IM920_PACKET_PAYLOAD_SIZE - 1)
 
 #define NOTICE_MAX_LEN	IM920_PACKET_PAYLOAD_SIZE
+#define NOTICE_TOPIC_I	0
+
+#define PARITY_GROUP_I	0
+#define PARITY_LENGTH_I	1
+#define PARITY_DATA_I	2
+#define PARITY_LENGTH_MASK_FRAG	(0x80)
+
+#define TELEMETRY_GENERATION_I	0
+#define TELEMETRY_REFERENCE_I	1
+#define TELEMETRY_COUNT_I		2
+#define TELEMETRY_SAMPLE_I		3
+#define TELEMETRY_COUNT_MASK	(0x7F)
+#define TELEMETRY_KEYFRAME		(0x80)
+#define TELEMETRY_VARINT_MAX	5
+
+// a bit field of the packet header, resolved at compile time
+template <uint8_t I, uint8_t MASK, uint8_t SHIFT = 0>
+struct PacketField
+{
+	static constexpr uint8_t get(const uint8_t a[]) { return (a[I] & MASK) >> SHIFT; };
+
+	static void set(uint8_t a[], uint8_t value) { a[I] = (a[I] & ~MASK) | ((value << SHIFT) & MASK); };
+};
+
+typedef PacketField<IM920_PACKET_LENGTH_I, IM920_PACKET_LENGTH_MASK> PacketLengthField;
+typedef PacketField<IM920_PACKET_VERSION_I, IM920_PACKET_VERSION_MASK, IM920_PACKET_VERSION_SHIFT> PacketVersionField;
+typedef PacketField<IM920_PACKET_TYPE_I, IM920_PACKET_TYPE_MASK> PacketTypeField;
+typedef PacketField<IM920_PACKET_FRAMEID_I, 0xFF> PacketFrameIDField;
+typedef PacketField<IM920_PACKET_SEQHIGH_I, 0xFF> PacketSeqHighField;
+typedef PacketField<IM920_PACKET_STREAM_I, 0xFF> PacketStreamField;
+
+static constexpr size_t _headerLength(const uint8_t a[])
+{
+	return PacketVersionField::get(a) == IM920_PACKET_VERSION_2 ? IM920_PACKET_HEADER_V2_SIZE : IM920_PACKET_HEADER_SIZE;
+}
+
+#define BRIDGE_MAGIC0		'I'
+#define BRIDGE_MAGIC1		'B'
+#define BRIDGE_COUNT_I		2
+#define BRIDGE_RECORD_I		3
+#define BRIDGE_RECORD_LENGTH_I	0
+#define BRIDGE_RECORD_NODEID_I	1
+#define BRIDGE_RECORD_MODULEID_I	2
+#define BRIDGE_RECORD_RSSI_I	4
+#define BRIDGE_RECORD_DATA_I	5
+
+// markers only clear bits from one erase of the slot to the next, so that flash backed storage can be written in place
+#define STORE_FREE			0xFF
+#define STORE_WRITING		0x7F
+#define STORE_COMMITTED		0x3F
+#define STORE_HANDED		0x1F
+#define STORE_MARKER_I		0
+#define STORE_SEQ_I			1
+#define STORE_MODULEID_I	3
+#define STORE_LENGTH_I		5
+#define STORE_DATA_I		6
+
+#define FLOW_ENABLED		0x01
+#define FLOW_ADVERTISE		0x02
+#define FLOW_STALLED		0x04
+#define FLOW_ANNOUNCED		0x08
+#define FLOW_ABANDONED		0x10
+#define FLOW_PROBE			"?"
+
+#define TELEMETRY_PEER_USED		0x01
+#define TELEMETRY_PEER_LATEST	0x02
+#define TELEMETRY_PEER_REFERENCE	0x04
+#define TOPIC_MAX_LEN	( NOTICE_MAX_LEN - IM920_TOPIC_SIZE )
+
+#define IM920_STATE_LISTEN	0x10
+#define IM920_STATE_RECEIVING_HDR_NODEID	0x30
+#define IM920_STATE_RECEIVING_HDR_MODULEID	0x31
+#define IM920_STATE_RECEIVING_HDR_RSSI		0x32
+#define IM920_STATE_RECEIVING_PACKET_HDR	0x33
+#define IM920_STATE_RECEIVING_PACKET_PAYLOAD	0x34
+#define IM920_STATE_RECEIVING_TERM	0x35
+#define IM920_STATE_COMPLETE	0x36
+#define IM920_STATE_SKIPPING	0x40
+
+#define IM920_EXEC_NONE		0
+#define IM920_EXEC_START	1
+#define IM920_EXEC_RUNNING	2
+#define IM920_EXEC_REPLY	3
+
+// "NN,MMMM,RR:" followed by ",XX" per byte and CR+LF
+#define IM920_RX_LINE_LENGTH	(11 + FRAME_PAYLOAD_SIZE * 3 + 2)
+
+#define IM920_OP_NONE		0
+#define IM920_OP_WRITE		1
+#define IM920_OP_RESPONSE	2
+#define IM920_LINE_HEX		0
+#define IM920_LINE_TEXT		1
+#define IM920_LINE_TEXT_P	2
+
+#define IM920_LINE_CLASS_LEN	3
+
+#define IM920_POWER_AWAKE	0
+#define IM920_POWER_ASLEEP	1
+#define IM920_POWER_WAKING	2
+#define IM920_POWER_DOZING	3
 
 AckPacket* AckPacket::_instance = nullptr;
 CommandPacket* CommandPacket::_instance = nullptr;
 DataPacket* DataPacket::_instance = nullptr;
 NoticePacket* NoticePacket::_instance = nullptr;
+ParityPacket* ParityPacket::_instance = nullptr;
+TelemetryPacket* TelemetryPacket::_instance = nullptr;
+
+static const char IM920_RESPONSE_OK[] PROGMEM = "OK";
+static const char IM920_RESPONSE_BOOT[] PROGMEM = "IM920 VER.";
+static const char IM920_COMMAND_DSRX[] PROGMEM = "DSRX";
+static const char IM920_COMMAND_ENRX[] PROGMEM = "ENRX";
+static const char IM920_COMMAND_TXDA[] PROGMEM = "TXDA";
+static const char IM920_COMMAND_TERM[] PROGMEM = "\r\n";
+static const char IM920_CAPTURE_MAGIC[] PROGMEM = "IM9C\x01";
+static const char IM920_HEX_DIGIT[] PROGMEM = "0123456789ABCDEF";
+
+#if IM920_DICTIONARY
+#define IM920_DICTIONARY_CODE	0x80
+#define IM920_DICTIONARY_WIDTH	8
+
+// tokens shared by both ends, sent as IM920_DICTIONARY_CODE | index; entries are only ever appended
+static const char IM920_DICTIONARY_TOKENS[][IM920_DICTIONARY_WIDTH] PROGMEM = {
+	"OK", "NG", "RDID", "RDNN", "RDCH", "RDPO", "RDRS", "RDRT",
+	"RDVR", "RDBR", "STNN", "STCH", "STPO", "STRT", "STBR", "SRST",
+	"ENWR", "DSWR", "DSRX", "ENRX", "TXDA", "ECIO", "DCIO", "PCLR",
+	"status", "event", "alarm", "error", "ready", "start", "stop", "open",
+	"close", "value", "temp", "humid", "batt", "on", "off"
+};
+
+#define IM920_DICTIONARY_SIZE	(sizeof(IM920_DICTIONARY_TOKENS) / IM920_DICTIONARY_WIDTH)
+#endif
+
+// nibble value of each ASCII character, 0xFF for a character that is not a hex digit
+static const uint8_t IM920_HEX_VALUE[128] PROGMEM = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+static inline uint8_t _hexValue(char c)
+{
+	if (c & 0x80) return 0xFF;
 
-static const PROGMEM char* const IM920_RESPONSE_OK = "OK";
-static const PROGMEM char* const IM920_COMMAND_TERM = "\r\n";
+	return pgm_read_byte(&IM920_HEX_VALUE[(uint8_t)c]);
+}
 
 #ifndef NDEBUG
 void __assert(const char *__func, const char *__file, int __lineno, const char *__sexp) {
@@ -78,6 +230,42 @@ static long _tick(long& count, unsigned long& previous)
 	return count;
 }
 
+IM920::IM920()
+	: _markedFailed(false), _adaptiveFragment(false), _frameID(0), _stream(IM920_STREAM_NONE), _txFrame(nullptr), _rxState(IM920_STATE_LISTEN), _rxStarted(0), _rxProgress(0), _rxAvailable(0), _exec(IM920_EXEC_NONE), _onReceive(nullptr), _onSent(nullptr), _timeSync(nullptr), _store(nullptr), _storeFrame(nullptr), _sleepLinger(0), _power(IM920_POWER_AWAKE), _powerSince(0), _powerIdle(0)
+#if IM920_FLOW_CONTROL
+	, _flowPeer(0), _flowWindow(0), _flowLastID(0), _flowAdvertised(0), _flowLimit(0), _flowState(0), _flowProbes(0), _flowHeard(0)
+#endif
+#if IM920_DICTIONARY
+	, _compress(false)
+#endif
+{
+	_stats.txFrames = 0;
+	_stats.txErrors = 0;
+	_stats.rxFrames = 0;
+	_stats.rxErrors = 0;
+	_stats.rxFiltered = 0;
+	_stats.rxRecovered = 0;
+	_stats.wakeups = 0;
+	_stats.awakeTime = 0;
+#if IM920_DICTIONARY
+	_stats.txSaved = 0;
+#endif
+
+#if IM920_FEC_GROUP_SIZE > 0
+	_fecSize = 0;
+	_fecCount = 0;
+	_fecLength = 0;
+	_fecMaxLength = 0;
+	_fecPending = false;
+	for (int i = 0; i < IM920_FEC_PAYLOAD_SIZE; i++) _fecParity[i] = 0;
+	_resetProtected();
+	_fecHeld = 0;
+#endif
+
+	clearSubscriptions();
+	clearAcceptFilter();
+}
+
 IM920& IM920::Instance()
 {
 	static IM920 _instance;
@@ -85,114 +273,67 @@ IM920& IM920::Instance()
 	return _instance;
 };
 
-int IM920::listen(IM920Frame& frame, long timeout)
+void IM920::poll()
 {
-#define IM920_STATE_LISTEN	0x10
-#define IM920_STATE_RECEIVING_HDR_NODEID	0x30
-#define IM920_STATE_RECEIVING_HDR_MODULEID	0x31
-#define IM920_STATE_RECEIVING_HDR_RSSI		0x32
-#define IM920_STATE_RECEIVING_PACKET_HDR	0x33
-#define IM920_STATE_RECEIVING_PACKET_PAYLOAD	0x34
+	// frames the library queues on its own are not waited for by a blocking sender
+	bool marking = _txQueue.setMarking(false);
+
+	if (_timeSync != nullptr && _timeSync->isMaster() && _txQueue.getFreeCount() > 1 && _timeSync->pollBeacon()) {
+		IM920Frame* frame = _txQueue.reserve();
+
+		NoticePacket::Instance().reset(*frame);
+
+		// the timestamp is written when the frame goes to the module
+		NoticePacket::Instance().setNotice(*frame, IM920_SYNC_TOPIC, "00000000");
+		_txQueue.commit(frame, IM920_TX_NOTICE);
+	}
+
+#if IM920_FLOW_CONTROL
+	if (_flowState & FLOW_ENABLED) _pollFlow();
+#endif
+
+	// stored frames go out one at a time while their destination is reachable
+	if (_store != nullptr && _storeFrame == nullptr && _txQueue.getFreeCount() > 1) {
+		IM920Frame* frame = _txQueue.reserve();
+
+		if (_store->peek(*frame)) {
+			_txQueue.commit(frame, IM920_TX_BULK);
+			_storeFrame = frame;
+		}
+	}
+
+	_pollTx();
+	_pollRx();
+
+	_txQueue.setMarking(marking);
+}
 
+int IM920::listen(IM920Frame& frame, long timeout)
+{
 	int ret = -1;
-	int state = IM920_STATE_LISTEN;
+	bool receiving = false;
 	unsigned long previous = millis();
 	
-	frame.clear();
-	
 	while (_tick(timeout, previous))
 	{
-		if (state == IM920_STATE_LISTEN) {
-			if (_im920.available()) {
-				if (timeout >= 0) {
-					// extend the timeout by some time needed to receive 64 bytes data.
-					timeout += ((_im920.getTxTimePerByte() << 6) >> 10) + 1;
-				}
-				
-				state = IM920_STATE_RECEIVING_HDR_NODEID;
-			}
-		} else if (state == IM920_STATE_RECEIVING_HDR_NODEID) {
-			if (_im920.available() < 3) continue;
-
-			frame.setNodeID(_im920.parseInt8());
-			
-			// discard ','
-			_im920.read();
-
-			state = IM920_STATE_RECEIVING_HDR_MODULEID;
-		} else if (state == IM920_STATE_RECEIVING_HDR_MODULEID) {
-			if (_im920.available() < 5) continue;
-
-			frame.setModuleID(_im920.parseInt16());
-			
-			// discard ','
-			_im920.read();
-
-			state = IM920_STATE_RECEIVING_HDR_RSSI;
-		} else if (state == IM920_STATE_RECEIVING_HDR_RSSI) {
-			if (_im920.available() < 3) continue;
-
-			frame.setRSSI(_im920.parseInt8());
-			
-			// discard ':'
-			_im920.read();
-			
-			state = IM920_STATE_RECEIVING_PACKET_HDR;
-		} else if (state == IM920_STATE_RECEIVING_PACKET_HDR) {
-			if (_im920.available() < 8) continue;
-
-			frame.put(_im920.parseInt8()); // read the frame length
-			_im920.read(); // discard ','
-			frame.put(_im920.parseInt8()); // read the flag
-			_im920.read(); // discard ','
-			frame.put(_im920.parseInt8()); // read the frame ID
-			
-			state = IM920_STATE_RECEIVING_PACKET_PAYLOAD;
-		} else if (state == IM920_STATE_RECEIVING_PACKET_PAYLOAD) {
-			PacketOperator& packet = PacketOperator::refInstance(frame);
-			size_t len = packet.getPacketLength(frame);
-			
-			assert(len > 0 && len <= IM920_PACKET_PAYLOAD_SIZE);
-			if (!(len > 0 && len <= IM920_PACKET_PAYLOAD_SIZE)) break;
-
-			while (_im920.available() >= 3 && packet.getPayloadLength(frame) < len)
-			{
-				_im920.read(); // discard ','
-				frame.put(_im920.parseInt8());
-			}
-			
-			if (packet.getPayloadLength(frame) == len) {
-				// discard CR+LF
-				while (_im920.read() != '\n');
-				
-				if (packet.getPacketType(frame) == IM920_PACKET_COMMAND) {
-					CommandPacket& command = static_cast<CommandPacket&>(packet);
-					uint8_t cmd = command.getCommand(frame);
-					
-					if (cmd == COMMAND_IM920_CMD) {
-						char response[ACK_PARAM_LEN + 1];
-						_im920.execIM920Cmd(command.getCommandParam(frame), response, sizeof(response));
-						
-						if (command.isAckRequested(frame)) {
-							AckPacket& ack = AckPacket::Instance();
-							ack.reset(frame);
-							ack.setCommand(frame, cmd);
-							ack.setResponse(frame, response);
-							send(frame);
-						}
-						
-						frame.clear();
-						state = IM920_STATE_LISTEN;
-						continue;
-					}
-				}
-				
-				ret = 0;
-				
-				break;
+		poll();
+
+		if (!receiving && _rxState != IM920_STATE_LISTEN) {
+			if (timeout >= 0) {
+				// extend the timeout by some time needed to receive 64 bytes data.
+				timeout += ((_im920.getTxTimePerByte() << 6) >> 10) + 1;
 			}
-		} else {
-			assert(false);
+
+			receiving = true;
+		}
+
+		if (_rxState == IM920_STATE_COMPLETE) {
+			frame = _rxFrame;
+
+			_rxFrame.clear();
+			_rxState = IM920_STATE_LISTEN;
+			ret = 0;
+
 			break;
 		}
 	}
@@ -202,36 +343,51 @@ int IM920::listen(IM920Frame& frame, long timeout)
 
 int IM920::send(IM920Frame& frame)
 {
-	size_t sentLen;
-	
-	sentLen = _send(frame);
-	if (!(sentLen == frame.getFrameLength())) return -1;
+	_markedFailed = false;
+	_txQueue.setMarking(true);
 
-	return 0;
+	while (enqueue(frame, IM920TxQueue::getPriority(frame)) < 0) poll();
+
+	return _flush();
+}
+
+size_t IM920::sendDataV(const IM920Segment segments[], size_t count, bool fragment)
+{
+	size_t sentLen = 0;
+	size_t length = 0;
+
+	for (size_t i = 0; i < count; i++) length += segments[i].length;
+
+	_markedFailed = false;
+	_txQueue.setMarking(true);
+
+	while (length - sentLen > 0)
+	{
+		sentLen += enqueueDataV(segments, count, sentLen, fragment);
+
+		poll();
+	}
+
+	_flush();
+
+	return sentLen;
 }
 
 size_t IM920::sendData(const uint8_t data[], size_t length, bool fragment)
 {
-	IM920Frame frame;
-	DataPacket& packet = DataPacket::Instance();
-	size_t sentLen = 0, ret = 0;
+	size_t sentLen = 0;
+
+	_markedFailed = false;
+	_txQueue.setMarking(true);
 
 	while (length - sentLen > 0)
 	{
-		packet.reset(frame);
-		
-		// set the fragment flag as the application demand
-		packet.setFragment(frame, fragment);
-		
-		sentLen += packet.setData(frame, data + sentLen, length - sentLen);
-		if (length - sentLen > 0) {
-			packet.setFragment(frame, true);
-		}
-		
-		ret = _send(frame);
+		sentLen += enqueueData(data + sentLen, length - sentLen, fragment);
 
-		assert(ret == frame.getFrameLength());
+		poll();
 	}
+
+	_flush();
 	
 	return sentLen;
 }
@@ -240,7 +396,6 @@ int IM920::sendCommand(uint8_t cmd, const char param[])
 {
 	IM920Frame frame;
 	CommandPacket& packet = CommandPacket::Instance();
-	size_t sentLen;
 	
 	packet.reset(frame);
 
@@ -249,17 +404,13 @@ int IM920::sendCommand(uint8_t cmd, const char param[])
 
 	packet.updatePacketLength(frame);
 	
-	sentLen = _send(frame);
-	if (!(sentLen == frame.getFrameLength())) return -1;
-	
-	return 0;
+	return send(frame);
 }
 
 int IM920::sendCommandWithAck(uint8_t cmd, const char param[])
 {
 	IM920Frame frame;
 	CommandPacket& packet = CommandPacket::Instance();
-	size_t sentLen;
 	
 	packet.reset(frame);
 
@@ -269,17 +420,13 @@ int IM920::sendCommandWithAck(uint8_t cmd, const char param[])
 
 	packet.updatePacketLength(frame);
 	
-	sentLen = _send(frame);
-	if (!(sentLen == frame.getFrameLength())) return -1;
-	
-	return 0;
+	return send(frame);
 }
 
 int IM920::sendAck(uint8_t cmd, const char response[])
 {
 	IM920Frame frame;
 	AckPacket& packet = AckPacket::Instance();
-	size_t sentLen;
 	
 	packet.reset(frame);
 	
@@ -288,770 +435,3970 @@ int IM920::sendAck(uint8_t cmd, const char response[])
 	
 	packet.updatePacketLength(frame);
 	
-	sentLen = _send(frame);
-	if (!(sentLen == frame.getFrameLength())) return -1;
-	
-	return 0;
+	return send(frame);
 }
 
 int IM920::sendNotice(const char notice[])
 {
 	IM920Frame frame;
 	NoticePacket& packet = NoticePacket::Instance();
-	size_t sentLen;
 	
 	packet.reset(frame);
 	
-	sentLen = packet.setNotice(frame, notice);
+	packet.setNotice(frame, notice);
 
-	sentLen = _send(frame);
-	if (!(sentLen == frame.getFrameLength())) return -1;
-	
-	return 0;
+	return send(frame);
 }
 
-IM920Interface& IM920::getInterface()
+int IM920::publish(const char topic[], const char message[])
 {
-	return _im920;
-}
+	IM920Frame frame;
+	NoticePacket& packet = NoticePacket::Instance();
 
-uint8_t IM920::_getNextFrameID()
-{
-	static uint8_t _sequence = 0;
-	return _sequence++;
+	packet.reset(frame);
+
+	packet.setNotice(frame, topic, message);
+
+	return send(frame);
 }
 
-size_t IM920::_send(IM920Frame& frame)
+void IM920::subscribe(const char topic[])
 {
-	size_t ret;
-	PacketOperator& packet = PacketOperator::refInstance(frame);
+	uint16_t hash = NoticePacket::getTopicHash(topic);
 
-	packet.setFrameID(frame, _getNextFrameID());
-	
-	ret = _im920.sendBytes(frame.getArray(), frame.getFrameLength());
-		
-	return ret;
+	// a two-bit bloom filter over the 14-bit topic hash
+	_topicFilter[(hash & 0x3F) >> 3] |= 1 << (hash & 0x07);
+	_topicFilter[((hash >> 6) & 0x3F) >> 3] |= 1 << ((hash >> 6) & 0x07);
+	_topicFiltering = true;
 }
 
-PacketOperator& PacketOperator::refInstance(int type)
+void IM920::clearSubscriptions()
 {
-	switch(type)
-	{
-		case IM920_PACKET_DATA:
-			return DataPacket::Instance();
+	for (int i = 0; i < IM920_TOPIC_FILTER_SIZE; i++) _topicFilter[i] = 0;
 
-		case IM920_PACKET_COMMAND:
-			return CommandPacket::Instance();
+	_topicFiltering = false;
+}
 
-		case IM920_PACKET_ACK:
-			return AckPacket::Instance();
+bool IM920::isSubscribed(uint16_t topic) const
+{
+	if (!_topicFiltering) return true;
 
-		case IM920_PACKET_NOTICE:
-			return NoticePacket::Instance();
+	if (!(_topicFilter[(topic & 0x3F) >> 3] & (1 << (topic & 0x07)))) return false;
 
-		default:
-			assert(false);
-			return;
-	}
+	return (_topicFilter[((topic >> 6) & 0x3F) >> 3] & (1 << ((topic >> 6) & 0x07))) != 0;
 }
 
-PacketOperator& PacketOperator::refInstance(const IM920Frame& frame)
+void IM920::setAcceptModule(uint16_t moduleID)
 {
-	int type;
-	
-	type = frame.getArray()[IM920_PACKET_TYPE_I] & IM920_PACKET_TYPE_MASK;
-	
-	return refInstance(type);
+	_acceptModuleID = moduleID;
+	_acceptFlags |= IM920_ACCEPT_MODULE;
 }
 
-void PacketOperator::reset(IM920Frame& frame, size_t size) const
+void IM920::setAcceptNode(uint8_t nodeID)
 {
-	frame.clear();
-	
-	frame.resetFrameLength(IM920_PACKET_HEADER_SIZE + size);
+	_acceptNodeID = nodeID;
+	_acceptFlags |= IM920_ACCEPT_NODE;
 }
 
-void PacketOperator::resetPayloadLength(IM920Frame& frame, size_t size) const
+void IM920::setAcceptTypes(uint8_t typeMask)
 {
-	frame.resetFrameLength(IM920_PACKET_HEADER_SIZE + size);
+	_acceptTypes = typeMask;
 }
 
-size_t PacketOperator::getPayloadLength(const IM920Frame& frame) const
+void IM920::setMinimumRSSI(uint8_t rssi)
 {
-	if (frame.getFrameLength() < IM920_PACKET_HEADER_SIZE) return 0;
-
-	return frame.getFrameLength() - IM920_PACKET_HEADER_SIZE;
+	_acceptRSSI = rssi;
 }
 
-uint8_t* PacketOperator::getPayloadArray(IM920Frame& frame) const
+void IM920::clearAcceptFilter()
 {
-	return frame.getArray() + IM920_PACKET_PAYLOAD_I;
+	_acceptFlags = 0;
+	_acceptModuleID = 0;
+	_acceptNodeID = 0;
+	_acceptTypes = 0xFF;
+	_acceptRSSI = 0;
 }
 
-const uint8_t* PacketOperator::getPayloadArray(const IM920Frame& frame) const
+void IM920::reportDelivery(size_t frameLength, bool lost)
 {
-	return frame.getArray() + IM920_PACKET_PAYLOAD_I;
+	_link.update(frameLength, lost);
 }
 
-uint8_t* PacketOperator::getPayloadTerminator(IM920Frame& frame) const
+#if IM920_FEC_GROUP_SIZE > 0
+void IM920::setFec(uint8_t groupSize)
 {
-	return frame.getTerminator();
-}
+	if (groupSize > IM920_FEC_GROUP_SIZE) groupSize = IM920_FEC_GROUP_SIZE;
 
-const uint8_t* PacketOperator::getPayloadTerminator(const IM920Frame& frame) const
-{
-	return frame.getTerminator();
-}
+	// a group in progress is closed with the old size
+	if (_fecCount > 0) _fecPending = true;
 
-size_t PacketOperator::getPacketHeaderLength(const IM920Frame& frame) const
-{
-	return IM920_PACKET_HEADER_SIZE;
+	_fecSize = groupSize;
 }
+#endif
 
-size_t PacketOperator::getPacketLength(const IM920Frame& frame) const
+int IM920::enqueue(const IM920Frame& frame, uint8_t priority)
 {
-	assert(frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
+	IM920Frame* slot = _txQueue.reserve();
 
-	return frame.getArray()[IM920_PACKET_LENGTH_I] & IM920_PACKET_LENGTH_MASK;
-}
+	if (slot == nullptr) return -1;
 
-int PacketOperator::getPacketType(const IM920Frame& frame) const
-{
-	assert(frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
-	
-	return frame.getArray()[IM920_PACKET_TYPE_I] & IM920_PACKET_TYPE_MASK;
-}
+	*slot = frame;
+	_txQueue.commit(slot, priority);
 
-bool PacketOperator::isFragmented(const IM920Frame& frame) const
-{
-	assert(frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
-	
-	return (frame.getArray()[IM920_PACKET_FLAG_I] & IM920_PACKET_FLAG_MASK_FRAG) != 0 ? true : false;
+	return 0;
 }
 
-bool PacketOperator::isAckRequested(const IM920Frame& frame) const
+size_t IM920::enqueueData(const uint8_t data[], size_t length, bool fragment)
 {
-	assert(frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
+	IM920Segment segment = { data, length };
 
-	return (frame.getArray()[IM920_PACKET_FLAG_I] & IM920_PACKET_FLAG_MASK_ACK) != 0 ? true : false;
+	return enqueueDataV(&segment, 1, 0, fragment);
 }
 
-uint8_t PacketOperator::getFrameID(const IM920Frame& frame) const
+size_t IM920::enqueueDataV(const IM920Segment segments[], size_t count, size_t offset, bool fragment)
 {
-	assert(frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
+	DataPacket& packet = DataPacket::Instance();
+	size_t queuedLen = 0;
+	size_t length = 0;
 
-	return frame.getArray()[IM920_PACKET_FRAMEID_I];
-}
+	for (size_t i = 0; i < count; i++) length += segments[i].length;
 
-void PacketOperator::setPacketLength(IM920Frame& frame, size_t length) const
-{
-	assert(frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
-	
-	frame.getArray()[IM920_PACKET_LENGTH_I] = length & IM920_PACKET_LENGTH_MASK;
-}
+	if (offset >= length) return 0;
+	length -= offset;
 
-void PacketOperator::setPacketType(IM920Frame& frame, uint8_t type) const
-{
-	assert (frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
+	// bulk data never takes the last free frame so that a command or an ack can always get in
+	while (length - queuedLen > 0 && _txQueue.getFreeCount() > 1)
+	{
+#if IM920_FEC_GROUP_SIZE > 0
+		// the parity of a closed group goes out before the next group starts
+		if (_fecPending && !_enqueueParity()) break;
+		if (_txQueue.getFreeCount() <= 1) break;
+#endif
+		IM920Frame* frame = _txQueue.reserve();
 
-	frame.getArray()[IM920_PACKET_TYPE_I] |= (frame.getArray()[IM920_PACKET_TYPE_I] & ~IM920_PACKET_TYPE_MASK) | type;
-}
+		packet.reset(*frame);
 
-void PacketOperator::setFragment(IM920Frame& frame, bool fragment) const
-{
-	if (fragment) frame.getArray()[IM920_PACKET_FLAG_I] |= IM920_PACKET_FLAG_MASK_FRAG;
-	else frame.getArray()[IM920_PACKET_FLAG_I] &= ~IM920_PACKET_FLAG_MASK_FRAG;
-}
+		// a selected stream goes out with the v2 header
+		if (_stream != IM920_STREAM_NONE) packet.setStreamID(*frame, _stream);
 
-void PacketOperator::setAckRequest(IM920Frame& frame, bool request) const
-{
-	if (request) frame.getArray()[IM920_PACKET_FLAG_I] |= IM920_PACKET_FLAG_MASK_ACK;
-	else frame.getArray()[IM920_PACKET_FLAG_I] &= ~IM920_PACKET_FLAG_MASK_ACK;
-}
+		// set the fragment flag as the application demand
+		packet.setFragment(*frame, fragment);
 
-void PacketOperator::setFrameID(IM920Frame& frame, uint8_t num) const
-{
-	frame.getArray()[IM920_PACKET_FRAMEID_I] = num;
-}
+		size_t size = length - queuedLen;
+		if (_adaptiveFragment && size > _link.getFragmentSize()) size = _link.getFragmentSize();
+#if IM920_FEC_GROUP_SIZE > 0
+		if (_fecSize > 0 && size > IM920_FEC_PAYLOAD_SIZE) size = IM920_FEC_PAYLOAD_SIZE;
+#endif
 
-void PacketOperator::updatePacketLength(IM920Frame& frame) const
-{
-	size_t length;
-	
-	length = getPayloadLength(frame);
-	
-	setPacketLength(frame, length);
-}
+		queuedLen += packet.setData(*frame, segments, count, offset + queuedLen, size);
+		if (length - queuedLen > 0) {
+			packet.setFragment(*frame, true);
+		}
 
-AckPacket::AckPacket()
-{
+#if IM920_FEC_GROUP_SIZE > 0
+		if (_fecSize > 0) _protect(*frame);
+#endif
+
+		_txQueue.commit(frame, IM920_TX_BULK);
+	}
+
+#if IM920_FEC_GROUP_SIZE > 0
+	if (_fecPending) _enqueueParity();
+#endif
+
+	return queuedLen;
 }
 
-AckPacket::~AckPacket()
+void IM920::setStream(int stream)
 {
+	_stream = stream;
 }
 
-AckPacket& AckPacket::Instance()
+IM920Interface& IM920::getInterface()
 {
-	if (_instance == nullptr) {
-		_instance = new AckPacket();
-	}
-
-	return *_instance;
+	return _im920;
 }
 
-void AckPacket::reset(IM920Frame& frame, size_t size) const
+void IM920::setTimeSync(IM920TimeSync* timeSync)
 {
-	PacketOperator::reset(frame, size);
-
-	setPacketType(frame, IM920_PACKET_ACK);
+	_timeSync = timeSync;
 }
 
-uint8_t AckPacket::getCommand(const IM920Frame& frame) const
+void IM920::setStore(IM920Store* store)
 {
-	return getPayloadArray(frame)[IM920_PACKET_ACK_CMD_I];
+	_store = store;
 }
 
-void AckPacket::setCommand(IM920Frame& frame, uint8_t cmd) const
+IM920RateLimiter& IM920::getRateLimiter()
 {
-	getPayloadArray(frame)[IM920_PACKET_ACK_CMD_I] = cmd;
+	return _limiter;
 }
 
-size_t AckPacket::getResponseLength(const IM920Frame& frame) const
+int IM920::_flush()
 {
-	assert( strlen( reinterpret_cast<const char*>(getPayloadArray(frame) + IM920_PACKET_ACK_PARAM_I)) == (getPacketLength(frame) - ACK_COMMAND_SIZE));
+	// only the frames marked by the blocking sender are waited for and counted
+	while (_txQueue.hasMarked()) poll();
 
-	return getPacketLength(frame) - ACK_COMMAND_SIZE;
-}
+#if IM920_FEC_GROUP_SIZE > 0
+	// the parity of the last group may still wait for a free frame
+	while (_fecPending && !_enqueueParity()) poll();
 
-size_t AckPacket::getResponse(const IM920Frame& frame, char buf[], size_t size) const
-{
-	const char* param = reinterpret_cast<const char*>( getPayloadArray(frame) + IM920_PACKET_ACK_PARAM_I);
-	size_t len = getResponseLength(frame);
-	
-	if (size < len + 1)
-		len = size - 1;
+	while (_txQueue.hasMarked()) poll();
+#endif
 
-	// '\0' character is not copied.
-	strncpy(buf, param, len);
-	buf[len] = '\0';
-	
-	return len;
-}
+	_txQueue.setMarking(false);
 
-const char* AckPacket::getResponse(const IM920Frame& frame) const
-{
-	return reinterpret_cast<const char*>(getPayloadArray(frame) + IM920_PACKET_ACK_PARAM_I);
+	return _markedFailed ? -1 : 0;
 }
 
-size_t AckPacket::setResponse(IM920Frame& frame, const char response[]) const
+void IM920::_pollTx()
 {
-	size_t responseLen = strlen(response);
+	int ret;
 
-	if (responseLen > ACK_PARAM_LEN) responseLen = ACK_PARAM_LEN;
-	
-	resetPayloadLength(frame, responseLen + ACK_COMMAND_SIZE);
+	if (_im920.isPending()) {
+		if (_exec == IM920_EXEC_RUNNING) {
+			// the response of the module overwrites the command parameter in place, its NUL may take the terminator byte
+			AckPacket& ack = AckPacket::Instance();
+			char* response = reinterpret_cast<char*>(ack.getPayloadArray(_rxFrame) + IM920_PACKET_ACK_PARAM_I);
+
+			ret = _im920.pollResponse(response, ack.getMaxPayloadLength(_rxFrame) - ACK_COMMAND_SIZE + 1);
+			if (ret != IM920_PENDING) _completeExec(ret);
+		} else if (_rxState == IM920_STATE_LISTEN || _rxState == IM920_STATE_COMPLETE) {
+			// received frames ahead of the answer go to the parser unless it still holds one or a command waits in it;
+			// otherwise they are dropped so that the answer, or its timeout, still comes
+			bool route = _rxState == IM920_STATE_LISTEN && _exec == IM920_EXEC_NONE;
+
+			ret = _im920.pollResponse(_txResponse, sizeof(_txResponse), route);
+
+			if (ret == IM920_DATA_LINE) {
+				// the node ID is already read, the parser takes the rest of the line
+				_rxFrame.setNodeID((_hexValue(_txResponse[0]) << 4) | _hexValue(_txResponse[1]));
+				_rxStarted = millis();
+				_rxProgress = _rxStarted;
+				_rxAvailable = -1;
+				_rxState = IM920_STATE_RECEIVING_HDR_MODULEID;
+			} else if (ret != IM920_PENDING) {
+				if (_power == IM920_POWER_WAKING || _power == IM920_POWER_DOZING) {
+					_completePower(ret);
+				} else {
+					_completeSend(ret);
+				}
+			}
+		}
+
+		return;
+	}
+
+	if (_exec == IM920_EXEC_START) {
+		CommandPacket& command = CommandPacket::Instance();
+
+		if (_im920.beginCommand(command.getCommandParam(_rxFrame)) == 0) {
+			_exec = IM920_EXEC_RUNNING;
+		} else if (_im920.getBusyTime() >= IM920_BUSY_TIMEOUT) {
+			// answered with an empty response rather than held forever
+			_completeExec(-1);
+		}
+
+		return;
+	}
+
+	if (_exec == IM920_EXEC_REPLY) _replyExec();
+
+#if IM920_FEC_GROUP_SIZE > 0
+	// the parity of the last group waits here when the queue was full
+	if (_fecPending) _enqueueParity();
+#endif
+
+	if ((_sleepLinger > 0 || _power != IM920_POWER_AWAKE) && _pollPower()) return;
+
+	// the response to a line started now would be taken for the tail of the skipped line
+	if (_rxState == IM920_STATE_SKIPPING) return;
+
+	IM920Frame* frame = _txQueue.peek();
+	if (frame == nullptr) return;
+
+	// hold the frame until the radio is allowed to transmit it
+	if (_limiter.getWaitTime(frame->getFrameLength()) > 0) return;
+
+#if IM920_FLOW_CONTROL
+	// data beyond the window advertised by the receiver waits for more credit
+	if ((_flowState & FLOW_ENABLED) && DataPacket::Instance().getPacketType(*frame) == IM920_PACKET_DATA) {
+		if ((int8_t)(_flowLimit - _frameID) <= 0) {
+			_flowState |= FLOW_STALLED;
+
+			if (_flowState & FLOW_ABANDONED) {
+				// the receiver never answered; the held frames fail one by one
+				_failHead();
+
+				// whatever comes next starts over with the initial window
+				if (_txQueue.count(IM920_TX_BULK) == 0) {
+					_flowLimit = _frameID + IM920_FLOW_INITIAL;
+					_flowState &= ~FLOW_ABANDONED;
+				}
+			}
+
+			return;
+		}
+
+		_flowState &= ~FLOW_STALLED;
+	}
+#endif
+
+	if (_timeSync != nullptr) {
+		// the whole frame has to fit in the own slot, from the start of its TXDA line to the end of the air time
+		unsigned long airTime = (_im920.getTxTimePerByte() * (2 * frame->getFrameLength() + 6) + _limiter.getAirTime(frame->getFrameLength()) + 999) / 1000;
+
+		// a frame longer than the slot would be held forever
+		if (!_timeSync->fitsSlot(airTime)) {
+			_failHead();
+
+			return;
+		}
+
+		if (_timeSync->getSlotWait(airTime) > 0) return;
+
+		if (_isBeacon(*frame)) _stampBeacon(*frame);
+	}
+
+#if IM920_DICTIONARY
+	if (_compress) _compressFrame(*frame);
+#endif
+
+	PacketOperator::refInstance(*frame).setSequence(*frame, _frameID);
+
+	if (_im920.beginSendBytes(frame->getArray(), frame->getFrameLength()) < 0) {
+		if (_im920.getBusyTime() >= IM920_BUSY_TIMEOUT) _failHead();
+
+		return;
+	}
+
+	_frameID++;
+	_txFrame = _txQueue.take();
+}
+
+void IM920::_pollRx()
+{
+	if (_exec != IM920_EXEC_NONE) return;
+
+	// the module answers commands on the same line as it delivers frames, so lines are started by the response reader meanwhile
+	if (_im920.isPending() && _rxState == IM920_STATE_LISTEN) return;
+
+	if (_rxState == IM920_STATE_COMPLETE) return;
+
+#if IM920_FEC_GROUP_SIZE > 0
+	// frames held back for reordering go out before anything new is parsed
+	if (_rxState == IM920_STATE_LISTEN) {
+		_expireProtected();
+
+		if (_releaseProtected()) return;
+	}
+#endif
+
+	uint8_t previousState = _rxState;
+
+	if (_rxState == IM920_STATE_LISTEN) {
+		if (!_im920.available()) return;
+
+		_rxStarted = millis();
+		_rxProgress = _rxStarted;
+		_rxAvailable = -1;
+		_rxState = IM920_STATE_RECEIVING_HDR_NODEID;
+	} else {
+		int available = _im920.available();
+
+		// a byte that arrived or was parsed since the last call counts as progress
+		if (available != _rxAvailable) {
+			_rxAvailable = available;
+			_rxProgress = millis();
+		} else if (millis() - _rxProgress > ((_im920.getTxTimePerByte() * IM920_RX_LINE_LENGTH) >> 10) + 1) {
+			if (_rxState == IM920_STATE_SKIPPING) {
+				// the tail of a cut line did not come either
+				_rxState = IM920_STATE_LISTEN;
+			} else {
+				// the rest of the line never came; whatever comes late is dropped up to LF
+				_stats.rxErrors++;
+				_rxFrame.clear();
+				_rxProgress = millis();
+				_rxState = IM920_STATE_SKIPPING;
+			}
+
+			return;
+		}
+	}
+
+	if (_rxState == IM920_STATE_RECEIVING_HDR_NODEID) {
+		if (_im920.available() < 3) return;
+
+		_rxFrame.setNodeID(_im920.parseInt8());
+		
+		// discard ','
+		_im920.read();
+
+		_rxState = IM920_STATE_RECEIVING_HDR_MODULEID;
+	} else if (_rxState == IM920_STATE_RECEIVING_HDR_MODULEID) {
+		if (_im920.available() < 5) return;
+
+		_rxFrame.setModuleID(_im920.parseInt16());
+		
+		// discard ','
+		_im920.read();
+
+		_rxState = IM920_STATE_RECEIVING_HDR_RSSI;
+	} else if (_rxState == IM920_STATE_RECEIVING_HDR_RSSI) {
+		if (_im920.available() < 3) return;
+
+		_rxFrame.setRSSI(_im920.parseInt8());
+		
+		// discard ':'
+		_im920.read();
+		
+		_rxState = IM920_STATE_RECEIVING_PACKET_HDR;
+	} else if (_rxState == IM920_STATE_RECEIVING_PACKET_HDR) {
+		if (_im920.available() < 8) return;
+
+		_rxFrame.put(_im920.parseInt8()); // read the frame length
+		_im920.read(); // discard ','
+		_rxFrame.put(_im920.parseInt8()); // read the flag
+		_im920.read(); // discard ','
+		_rxFrame.put(_im920.parseInt8()); // read the frame ID
+
+		if (PacketTypeField::get(_rxFrame.getArray()) >= IM920_PACKET_TYPE || PacketVersionField::get(_rxFrame.getArray()) > IM920_PACKET_VERSION_2) {
+			// a packet type or header version this library does not know
+			_stats.rxErrors++;
+			_rxFrame.clear();
+			_rxState = IM920_STATE_SKIPPING;
+
+			return;
+		}
+		
+		_rxState = IM920_STATE_RECEIVING_PACKET_PAYLOAD;
+	} else if (_rxState == IM920_STATE_RECEIVING_PACKET_PAYLOAD) {
+		PacketOperator& packet = PacketOperator::refInstance(_rxFrame);
+		size_t len = packet.getPacketLength(_rxFrame);
+		size_t header = packet.getPacketHeaderLength(_rxFrame);
+		
+		if (!(len > 0 && len <= packet.getMaxPayloadLength(_rxFrame))) {
+			_stats.rxErrors++;
+			_rxFrame.clear();
+			_rxState = IM920_STATE_SKIPPING;
+
+			return;
+		}
+
+		// decode every complete ",XX" that has arrived in one go, the rest of a v2 header included
+		size_t have = _rxFrame.getFrameLength();
+		size_t n = _im920.available() / 3;
+		if (n > header + len - have) n = header + len - have;
+
+		// a topic notice is judged on its topic before the rest of the line is decoded
+		NoticePacket& notice = NoticePacket::Instance();
+		bool screen = _topicFiltering && have < header + IM920_TOPIC_SIZE && notice.hasTopic(_rxFrame);
+		if (screen && n > header + IM920_TOPIC_SIZE - have) n = header + IM920_TOPIC_SIZE - have;
+
+		if (n > 0) {
+			n = _im920.readHexList(_rxFrame.getTerminator(), n);
+			_rxFrame.resetFrameLength(_rxFrame.getFrameLength() + n);
+		}
+
+		if (screen && _rxFrame.getFrameLength() == header + IM920_TOPIC_SIZE && !isSubscribed(notice.getTopic(_rxFrame))) {
+			_stats.rxFiltered++;
+			_rxFrame.clear();
+			_rxState = IM920_STATE_SKIPPING;
+
+			return;
+		}
+		
+		if (_rxFrame.getFrameLength() == header + len) _rxState = IM920_STATE_RECEIVING_TERM;
+	} else if (_rxState == IM920_STATE_RECEIVING_TERM || _rxState == IM920_STATE_SKIPPING) {
+		// discard the rest of the line up to LF
+		while (_im920.available()) {
+			if (_im920.read() != '\n') continue;
+
+			if (_rxState == IM920_STATE_SKIPPING) {
+				_rxState = IM920_STATE_LISTEN;
+			} else {
+				_completeReceive();
+			}
+
+			break;
+		}
+	} else {
+		assert(false);
+		_rxState = IM920_STATE_LISTEN;
+	}
+
+	if (_im920.checkParseError()) {
+		// a malformed digit spoils the whole line
+		_stats.rxErrors++;
+		_rxFrame.clear();
+		_rxState = IM920_STATE_SKIPPING;
+	} else if (_rxState != previousState && !_isAccepted()) {
+		// an unwanted frame is dropped as soon as its header tells so
+		_stats.rxFiltered++;
+		_rxFrame.clear();
+		_rxState = IM920_STATE_SKIPPING;
+	}
+}
+
+bool IM920::_isAccepted() const
+{
+	if (_rxState < IM920_STATE_RECEIVING_HDR_MODULEID || _rxState > IM920_STATE_RECEIVING_PACKET_PAYLOAD) return true;
+
+	if ((_acceptFlags & IM920_ACCEPT_NODE) && _rxFrame.getNodeID() != _acceptNodeID) return false;
+
+	if (_rxState == IM920_STATE_RECEIVING_HDR_MODULEID) return true;
+
+	if ((_acceptFlags & IM920_ACCEPT_MODULE) && _rxFrame.getModuleID() != _acceptModuleID) return false;
+
+	if (_rxState == IM920_STATE_RECEIVING_HDR_RSSI) return true;
+
+	if (_rxFrame.getRSSI() < _acceptRSSI) return false;
+
+	if (_rxState == IM920_STATE_RECEIVING_PACKET_HDR) return true;
+
+	return (_acceptTypes & (1 << (_rxFrame.getArray()[IM920_PACKET_TYPE_I] & IM920_PACKET_TYPE_MASK))) != 0;
+}
+
+void IM920::_completeReceive()
+{
+	PacketOperator& packet = PacketOperator::refInstance(_rxFrame);
+
+	_stats.rxFrames++;
+	_link.updateRSSI(_rxFrame.getRSSI());
+
+#if IM920_DICTIONARY
+	// tokens are expanded in place before anything looks at the text
+	if (packet.isCompressed(_rxFrame) && !_expandFrame(_rxFrame)) {
+		_stats.rxErrors++;
+		_rxFrame.clear();
+		_rxState = IM920_STATE_LISTEN;
+
+		return;
+	}
+#endif
+
+	if (_store != nullptr) _store->markReachable(_rxFrame.getModuleID());
+
+#if IM920_FLOW_CONTROL
+	if ((_flowState & FLOW_ENABLED) && _rxFrame.getModuleID() == _flowPeer) {
+		_flowLastID = packet.getFrameID(_rxFrame);
+
+		// a new advertisement goes out with the first frame and then once half of the window has been used
+		if (_flowWindow > 0) {
+			if (!(_flowState & FLOW_ANNOUNCED) || (uint8_t)(_flowLastID + 1 + _flowWindow - _flowAdvertised) >= (_flowWindow + 1) / 2) _flowState |= FLOW_ADVERTISE;
+		}
+
+		if (_isFlowNotice(_rxFrame)) {
+			_receiveFlow();
+
+			return;
+		}
+	}
+#endif
+
+	if (_timeSync != nullptr && _isBeacon(_rxFrame)) {
+		_receiveBeacon();
+
+		return;
+	}
+
+#if IM920_FEC_GROUP_SIZE > 0
+	if (packet.getPacketType(_rxFrame) == IM920_PACKET_PARITY) {
+		_recoverProtected();
+
+		return;
+	}
+
+	if (packet.getPacketType(_rxFrame) == IM920_PACKET_DATA && DataPacket::Instance().getFecIndex(_rxFrame) > 0) {
+		if (_holdProtected()) return;
+	}
+#endif
+
+	if (packet.getPacketType(_rxFrame) == IM920_PACKET_COMMAND) {
+		CommandPacket& command = static_cast<CommandPacket&>(packet);
+
+		if (command.getCommand(_rxFrame) == COMMAND_IM920_CMD) {
+			// the frame is kept until the module has executed the command
+			_exec = IM920_EXEC_START;
+			_rxState = IM920_STATE_LISTEN;
+
+			return;
+		}
+	}
+
+	_deliver();
+}
+
+bool IM920::_isBeacon(const IM920Frame& frame)
+{
+	NoticePacket& notice = NoticePacket::Instance();
+
+	if (notice.getPacketType(frame) != IM920_PACKET_NOTICE || !notice.hasTopic(frame)) return false;
+
+	return notice.getTopic(frame) == NoticePacket::getTopicHash(IM920_SYNC_TOPIC) && strlen(notice.getMessage(frame)) == IM920_SYNC_DIGITS;
+}
+
+void IM920::_stampBeacon(IM920Frame& frame)
+{
+	char* digits = const_cast<char*>(NoticePacket::Instance().getMessage(frame));
+	unsigned long now = _timeSync->now();
+
+	for (int i = IM920_SYNC_DIGITS - 1; i >= 0; i--) {
+		digits[i] = pgm_read_byte(&IM920_HEX_DIGIT[now & 0x0F]);
+		now >>= 4;
+	}
+}
+
+void IM920::_receiveBeacon()
+{
+	const char* digits = NoticePacket::Instance().getMessage(_rxFrame);
+	unsigned long remote = 0;
+
+	for (int i = 0; i < IM920_SYNC_DIGITS; i++) remote = (remote << 4) | _hexValue(digits[i]);
+
+	// the beacon was stamped when its TXDA line started, so add the line and the air time
+	unsigned long delay = _im920.getTxTimePerByte() * (2 * _rxFrame.getFrameLength() + 6) + _limiter.getAirTime(_rxFrame.getFrameLength());
+
+	if (!_timeSync->isMaster()) _timeSync->update(remote + delay / 1000, _rxStarted);
+
+	_rxFrame.clear();
+	_rxState = IM920_STATE_LISTEN;
+}
+
+#if IM920_FLOW_CONTROL
+bool IM920::_isFlowNotice(const IM920Frame& frame)
+{
+	NoticePacket& notice = NoticePacket::Instance();
+
+	if (notice.getPacketType(frame) != IM920_PACKET_NOTICE || !notice.hasTopic(frame)) return false;
+
+	return notice.getTopic(frame) == NoticePacket::getTopicHash(IM920_FLOW_TOPIC);
+}
+
+void IM920::_receiveFlow()
+{
+	const char* message = NoticePacket::Instance().getMessage(_rxFrame);
+
+	if (strcmp(message, FLOW_PROBE) == 0) {
+		// a stalled sender asks for the current window
+		if (_flowWindow > 0) _flowState |= FLOW_ADVERTISE;
+	} else if (strlen(message) == 2) {
+		_flowLimit = (_hexValue(message[0]) << 4) | _hexValue(message[1]);
+		_flowHeard = millis();
+		_flowProbes = 0;
+		_flowState &= ~FLOW_ABANDONED;
+	}
+
+	_rxFrame.clear();
+	_rxState = IM920_STATE_LISTEN;
+}
+
+void IM920::_pollFlow()
+{
+	NoticePacket& notice = NoticePacket::Instance();
+	char message[3];
+	uint8_t limit = 0;
+
+	// bulk data leaves the last free frame for notices like this one
+	if (_txQueue.isFull()) return;
+
+	if (_flowState & FLOW_ADVERTISE) {
+		limit = _flowLastID + 1 + _getFlowWindow();
+
+		message[0] = pgm_read_byte(&IM920_HEX_DIGIT[limit >> 4]);
+		message[1] = pgm_read_byte(&IM920_HEX_DIGIT[limit & 0x0F]);
+		message[2] = '\0';
+	} else if ((_flowState & (FLOW_STALLED | FLOW_ABANDONED)) == FLOW_STALLED && millis() - _flowHeard >= IM920_FLOW_PROBE) {
+		_flowHeard = millis();
+
+		if (_flowProbes >= IM920_FLOW_PROBES) {
+			// the held frames are given up rather than kept forever
+			_flowProbes = 0;
+			_flowState |= FLOW_ABANDONED;
+
+			return;
+		}
+
+		// probe the receiver instead of pushing data into a closed window
+		strcpy(message, FLOW_PROBE);
+		_flowProbes++;
+	} else {
+		return;
+	}
+
+	IM920Frame* frame = _txQueue.reserve();
+
+	notice.reset(*frame);
+	notice.setNotice(*frame, IM920_FLOW_TOPIC, message);
+	_txQueue.commit(frame, IM920_TX_NOTICE);
+
+	if (_flowState & FLOW_ADVERTISE) {
+		_flowAdvertised = limit;
+		_flowState &= ~FLOW_ADVERTISE;
+		_flowState |= FLOW_ANNOUNCED;
+	}
+}
+
+uint8_t IM920::_getFlowWindow()
+{
+#if IM920_RX_RING_SIZE > 0
+	// a receiver that falls behind offers only the share of its window that the ring can still take
+	size_t pending = _im920.available();
+
+	if (pending >= IM920_RX_RING_SIZE) return 0;
+
+	return ((unsigned long)_flowWindow * (IM920_RX_RING_SIZE - pending) + IM920_RX_RING_SIZE - 1) / IM920_RX_RING_SIZE;
+#else
+	return _flowWindow;
+#endif
+}
+
+void IM920::setFlowControl(uint16_t moduleID, uint8_t window)
+{
+	if (window > 127) window = 127;
+
+	_flowPeer = moduleID;
+	_flowWindow = window;
+	_flowLimit = _frameID + IM920_FLOW_INITIAL;
+	_flowAdvertised = 0;
+	_flowHeard = millis();
+	_flowProbes = 0;
+	// until the receiver has announced its window only a few data frames go out
+	_flowState = FLOW_ENABLED;
+}
+
+bool IM920::isFlowStalled() const
+{
+	return (_flowState & FLOW_STALLED) != 0;
+}
+#endif
+
+void IM920::_deliver()
+{
+	if (_onReceive != nullptr) {
+		_onReceive(_rxFrame);
+
+		_rxFrame.clear();
+		_rxState = IM920_STATE_LISTEN;
+	} else {
+		_rxState = IM920_STATE_COMPLETE;
+	}
+}
+
+#if IM920_FEC_GROUP_SIZE > 0
+void IM920::_protect(IM920Frame& frame)
+{
+	DataPacket& packet = DataPacket::Instance();
+	const uint8_t* data = packet.getData(frame);
+	size_t len = packet.getDataLength(frame);
+
+	packet.setFecIndex(frame, ++_fecCount);
+
+	for (size_t i = 0; i < len; i++) _fecParity[i] ^= data[i];
+	_fecLength ^= len | (packet.isFragmented(frame) ? PARITY_LENGTH_MASK_FRAG : 0);
+	if (len > _fecMaxLength) _fecMaxLength = len;
+
+	// a group closes when it is full or the message ends
+	if (_fecCount == _fecSize || !packet.isFragmented(frame)) _fecPending = true;
+}
+
+bool IM920::_enqueueParity()
+{
+	ParityPacket& packet = ParityPacket::Instance();
+
+	if (_txQueue.getFreeCount() <= 1) return false;
+
+	IM920Frame* frame = _txQueue.reserve();
+
+	packet.reset(*frame, PARITY_DATA_I + _fecMaxLength);
+
+	uint8_t* buf = packet.getPayloadArray(*frame);
+	buf[PARITY_GROUP_I] = _fecCount;
+	buf[PARITY_LENGTH_I] = _fecLength;
+	memcpy(buf + PARITY_DATA_I, _fecParity, _fecMaxLength);
+
+	packet.updatePacketLength(*frame);
+
+	_txQueue.commit(frame, IM920_TX_BULK);
+
+	for (int i = 0; i < IM920_FEC_PAYLOAD_SIZE; i++) _fecParity[i] = 0;
+	_fecCount = 0;
+	_fecLength = 0;
+	_fecMaxLength = 0;
+	_fecPending = false;
+
+	return true;
+}
+
+bool IM920::_holdProtected()
+{
+	uint8_t i = DataPacket::Instance().getFecIndex(_rxFrame) - 1;
+
+	// a group larger than the receive buffer is passed through unprotected
+	if (i >= IM920_FEC_GROUP_SIZE) return false;
+
+	// a group belongs to one sender; others are passed through until it closes
+	if (_isProtecting() && _rxFrame.getModuleID() != _fecModule) return false;
+
+	if (i < _fecNext || (_fecMask & (1 << i))) {
+		// a new group began before the parity of the previous one came
+		for (uint8_t j = _fecNext; j < IM920_FEC_GROUP_SIZE; j++) {
+			if (_fecMask & (1 << j)) _stats.rxErrors++;
+		}
+
+		_resetProtected();
+	}
+
+	_fecFrames[i] = _rxFrame;
+	_fecMask |= 1 << i;
+	_fecModule = _rxFrame.getModuleID();
+	_fecHeld = millis();
+
+	_rxFrame.clear();
+	_rxState = IM920_STATE_LISTEN;
+
+	return true;
+}
+
+void IM920::_recoverProtected()
+{
+	DataPacket& data = DataPacket::Instance();
+	ParityPacket& parity = ParityPacket::Instance();
+	const uint8_t* buf = parity.getPayloadArray(_rxFrame);
+	uint8_t count = buf[PARITY_GROUP_I];
+	uint8_t missing = IM920_FEC_GROUP_SIZE;
+
+	// parity is never applied to frames of another sender, and a group with
+	// no frame held was passed through or lost as a whole
+	if (count == 0 || count > IM920_FEC_GROUP_SIZE || parity.getPacketLength(_rxFrame) < PARITY_DATA_I ||
+		(_isProtecting() ? _rxFrame.getModuleID() != _fecModule : count > 1)) {
+		_rxFrame.clear();
+		_rxState = IM920_STATE_LISTEN;
+
+		return;
+	}
+
+	for (uint8_t i = 0; i < count; i++) {
+		if (_fecMask & (1 << i)) continue;
+
+		// more than one frame lost cannot be rebuilt
+		if (missing != IM920_FEC_GROUP_SIZE) {
+			missing = IM920_FEC_GROUP_SIZE;
+			break;
+		}
+		missing = i;
+	}
+
+	if (missing < count && missing >= _fecNext) {
+		IM920Frame& frame = _fecFrames[missing];
+		size_t parityLength = parity.getPacketLength(_rxFrame) - PARITY_DATA_I;
+		uint8_t length = buf[PARITY_LENGTH_I];
+
+		data.reset(frame, parityLength);
+		uint8_t* rebuilt = data.getPayloadArray(frame);
+		memcpy(rebuilt, buf + PARITY_DATA_I, parityLength);
+
+		for (uint8_t i = 0; i < count; i++) {
+			if (i == missing) continue;
+
+			const uint8_t* other = data.getData(_fecFrames[i]);
+			size_t otherLength = data.getDataLength(_fecFrames[i]);
+
+			for (size_t j = 0; j < otherLength && j < parityLength; j++) rebuilt[j] ^= other[j];
+			length ^= otherLength | (data.isFragmented(_fecFrames[i]) ? PARITY_LENGTH_MASK_FRAG : 0);
+		}
+
+		if ((length & ~PARITY_LENGTH_MASK_FRAG) <= parityLength) {
+			data.resetPayloadLength(frame, length & ~PARITY_LENGTH_MASK_FRAG);
+			data.updatePacketLength(frame);
+			data.setFragment(frame, (length & PARITY_LENGTH_MASK_FRAG) != 0);
+			data.setFecIndex(frame, missing + 1);
+			frame.setNodeID(_rxFrame.getNodeID());
+			frame.setModuleID(_rxFrame.getModuleID());
+			frame.setRSSI(_rxFrame.getRSSI());
+
+			_fecMask |= 1 << missing;
+			_stats.rxRecovered++;
+		}
+	}
+
+	_fecEnd = count;
+	_fecModule = _rxFrame.getModuleID();
+
+	_rxFrame.clear();
+	_rxState = IM920_STATE_LISTEN;
+}
+
+void IM920::_expireProtected()
+{
+	if (_fecMask == 0 || _fecEnd > 0) return;
+
+	// the rest of the group or its parity should have come within a few frame times
+	unsigned long frameTime = _im920.getTxTimePerByte() * (2 * FRAME_PAYLOAD_SIZE + 6) + _limiter.getAirTime(FRAME_PAYLOAD_SIZE);
+
+	if (millis() - _fecHeld < frameTime * IM920_FEC_HOLD_FRAMES / 1000) return;
+
+	// the parity was lost; the group is closed after the last frame held and the gaps are counted as lost
+	uint8_t end = IM920_FEC_GROUP_SIZE;
+	while (!(_fecMask & (1 << (end - 1)))) end--;
+
+	_fecEnd = end;
+}
+
+bool IM920::_releaseProtected()
+{
+	bool ret = false;
+
+	while (_fecNext < IM920_FEC_GROUP_SIZE)
+	{
+		if (_fecMask & (1 << _fecNext)) {
+			_rxFrame = _fecFrames[_fecNext++];
+			_deliver();
+			ret = true;
+			break;
+		}
+
+		// wait for the missing frame or the parity as long as the group is open
+		if (_fecEnd == 0 || _fecNext >= _fecEnd) break;
+
+		// the group is closed and the frame is lost
+		_stats.rxErrors++;
+		_fecNext++;
+	}
+
+	if (_fecEnd > 0 && _fecNext >= _fecEnd) _resetProtected();
+
+	return ret;
+}
+
+void IM920::_resetProtected()
+{
+	_fecMask = 0;
+	_fecNext = 0;
+	_fecEnd = 0;
+	_fecModule = 0;
+}
+
+bool IM920::_isProtecting() const
+{
+	return _fecMask != 0 || _fecNext != 0 || _fecEnd != 0;
+}
+#endif
+
+void IM920::_completeSend(int ret)
+{
+	int result = -1;
+
+	if (ret > 0 && strncmp_P(_txResponse, IM920_RESPONSE_OK, 2) == 0) result = 0;
+
+	if (result == 0) {
+		_limiter.consume(_txFrame->getFrameLength());
+		_stats.txFrames++;
+	} else {
+		_stats.txErrors++;
+		if (_txQueue.isMarked(_txFrame)) _markedFailed = true;
+	}
+
+	if (_onSent != nullptr) _onSent(*_txFrame, result);
+
+	if (_txFrame == _storeFrame) {
+		_store->complete(result == 0);
+		_storeFrame = nullptr;
+	}
+
+	_txQueue.release(_txFrame);
+	_txFrame = nullptr;
+
+	// the linger period starts over after every frame
+	_powerIdle = millis();
+}
+
+void IM920::_failHead()
+{
+	// reported as failed so that the queue and blocking senders move on
+	_txFrame = _txQueue.take();
+	if (_txFrame != nullptr) _completeSend(-1);
+}
+
+bool IM920::_pollPower()
+{
+	// a module left asleep when the manager was turned off is woken right away
+	if (_txQueue.isEmpty() && _sleepLinger > 0) {
+		// the module goes back to sleep once no frame has come for the linger period
+		if (_power == IM920_POWER_AWAKE && millis() - _powerIdle >= _sleepLinger) {
+			if (_im920.beginSleep() == 0) _power = IM920_POWER_DOZING;
+		}
+
+		return true;
+	}
+
+	if (_power == IM920_POWER_ASLEEP) {
+		if (_im920.beginWakeUp() == 0) {
+			_power = IM920_POWER_WAKING;
+		} else if (_im920.getBusyTime() >= IM920_BUSY_TIMEOUT) {
+			_failHead();
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+void IM920::_accountAwake()
+{
+	if (_power != IM920_POWER_AWAKE && _power != IM920_POWER_DOZING) return;
+
+	unsigned long now = millis();
+
+	_stats.awakeTime += now - _powerSince;
+	_powerSince = now;
+}
+
+void IM920::_completePower(int ret)
+{
+	bool ok = ret > 0 && strncmp_P(_txResponse, IM920_RESPONSE_OK, 2) == 0;
+
+	if (_power == IM920_POWER_WAKING) {
+		// a failed wake up is tried again on the next poll, at the cost of the frame waiting for it
+		if (!ok) {
+			_power = IM920_POWER_ASLEEP;
+			_failHead();
+
+			return;
+		}
+
+		_stats.wakeups++;
+		_powerSince = millis();
+		_powerIdle = _powerSince;
+		_power = IM920_POWER_AWAKE;
+	} else {
+		if (!ok) {
+			_power = IM920_POWER_AWAKE;
+			_powerIdle = millis();
+
+			return;
+		}
+
+		_accountAwake();
+		_power = IM920_POWER_ASLEEP;
+	}
+}
+
+const IM920Stats& IM920::getStats()
+{
+	// the time awake so far counts without waiting for the module to go to sleep
+	if (_sleepLinger > 0) _accountAwake();
+
+	return _stats;
+}
+
+void IM920::setAutoSleep(uint16_t linger)
+{
+	if (_sleepLinger > 0) {
+		_accountAwake();
+	} else if (_power == IM920_POWER_AWAKE) {
+		// the module is taken as awake when the manager starts
+		_powerSince = millis();
+		_powerIdle = _powerSince;
+	}
+
+	_sleepLinger = linger;
+}
+
+bool IM920::isAwake() const
+{
+	return _power == IM920_POWER_AWAKE;
+}
+
+#if IM920_DICTIONARY
+void IM920::setCompression(bool enable)
+{
+	_compress = enable;
+}
+
+// offset of the text in a packet that carries one, or the payload length when there is none
+static size_t _textOffset(const IM920Frame& frame)
+{
+	NoticePacket& notice = NoticePacket::Instance();
+	int type = notice.getPacketType(frame);
+
+	if (type == IM920_PACKET_COMMAND) return IM920_PACKET_COMMAND_PARAM_I;
+	if (type == IM920_PACKET_ACK) return IM920_PACKET_ACK_PARAM_I;
+	if (type == IM920_PACKET_NOTICE) return notice.hasTopic(frame) ? IM920_TOPIC_SIZE : 0;
+
+	return notice.getPayloadLength(frame);
+}
+
+void IM920::_compressFrame(IM920Frame& frame)
+{
+	PacketOperator& packet = PacketOperator::refInstance(frame);
+	size_t offset = _textOffset(frame);
+	size_t length = packet.getPayloadLength(frame);
+
+	if (offset >= length || packet.isCompressed(frame)) return;
+
+	uint8_t* text = packet.getPayloadArray(frame) + offset;
+	uint8_t buf[FRAME_PAYLOAD_SIZE];
+	size_t n = IM920Dictionary::encode(text, length - offset, buf, sizeof(buf));
+
+	// left as it is when nothing matched
+	if (n == 0 || n >= length - offset) return;
+
+	memcpy(text, buf, n);
+	text[n] = '\0';
+	packet.resetPayloadLength(frame, offset + n);
+	packet.updatePacketLength(frame);
+	frame.getArray()[IM920_PACKET_FLAG_I] |= IM920_PACKET_FLAG_MASK_DICT;
+
+	_stats.txSaved += length - offset - n;
+}
+
+bool IM920::_expandFrame(IM920Frame& frame)
+{
+	PacketOperator& packet = PacketOperator::refInstance(frame);
+	size_t offset = _textOffset(frame);
+	size_t length = packet.getPayloadLength(frame);
+	size_t room = packet.getMaxPayloadLength(frame) - offset;
+
+	if (offset > length) return false;
+
+	uint8_t* text = packet.getPayloadArray(frame) + offset;
+	uint8_t buf[FRAME_PAYLOAD_SIZE];
+	int n = IM920Dictionary::decode(text, length - offset, buf, room);
+
+	if (n < 0) return false;
+
+	memcpy(text, buf, n);
+	text[n] = '\0';
+	packet.resetPayloadLength(frame, offset + n);
+	packet.updatePacketLength(frame);
+	frame.getArray()[IM920_PACKET_FLAG_I] &= ~IM920_PACKET_FLAG_MASK_DICT;
+
+	return true;
+}
+#endif
+
+void IM920::_completeExec(int ret)
+{
+	CommandPacket& command = CommandPacket::Instance();
+	AckPacket& ack = AckPacket::Instance();
+
+	if (command.isAckRequested(_rxFrame)) {
+		uint8_t* header = _rxFrame.getArray();
+		size_t len = ret > 0 ? ret : 0;
+
+		// turn the command frame into the ack, keeping the command and the response in place
+		header[IM920_PACKET_TYPE_I] &= ~(IM920_PACKET_TYPE_MASK | IM920_PACKET_FLAG_MASK);
+		header[IM920_PACKET_TYPE_I] |= IM920_PACKET_ACK;
+		ack.resetPayloadLength(_rxFrame, len + ACK_COMMAND_SIZE);
+		ack.updatePacketLength(_rxFrame);
+
+		_exec = IM920_EXEC_REPLY;
+		_replyExec();
+
+		return;
+	}
+
+	_rxFrame.clear();
+	_exec = IM920_EXEC_NONE;
+}
+
+void IM920::_replyExec()
+{
+	// the ack waits in the received frame until the queue has room
+	if (enqueue(_rxFrame, IM920_TX_ACK) < 0) return;
+
+	_rxFrame.clear();
+	_exec = IM920_EXEC_NONE;
+}
+
+PacketOperator& PacketOperator::refInstance(int type)
+{
+	switch(type)
+	{
+		case IM920_PACKET_DATA:
+			return DataPacket::Instance();
+
+		case IM920_PACKET_COMMAND:
+			return CommandPacket::Instance();
+
+		case IM920_PACKET_ACK:
+			return AckPacket::Instance();
+
+		case IM920_PACKET_NOTICE:
+			return NoticePacket::Instance();
+
+		case IM920_PACKET_PARITY:
+			return ParityPacket::Instance();
+
+		case IM920_PACKET_TELEMETRY:
+			return TelemetryPacket::Instance();
+
+		default:
+			assert(false);
+			return;
+	}
+}
+
+PacketOperator& PacketOperator::refInstance(const IM920Frame& frame)
+{
+	int type;
+	
+	type = PacketTypeField::get(frame.getArray());
+	
+	return refInstance(type);
+}
+
+void PacketOperator::reset(IM920Frame& frame, size_t size) const
+{
+	frame.clear();
+	
+	frame.resetFrameLength(IM920_PACKET_HEADER_SIZE + size);
+}
+
+void PacketOperator::resetPayloadLength(IM920Frame& frame, size_t size) const
+{
+	frame.resetFrameLength(getPacketHeaderLength(frame) + size);
+}
+
+size_t PacketOperator::getPayloadLength(const IM920Frame& frame) const
+{
+	size_t header = getPacketHeaderLength(frame);
+
+	if (frame.getFrameLength() < header) return 0;
+
+	return frame.getFrameLength() - header;
+}
+
+uint8_t* PacketOperator::getPayloadArray(IM920Frame& frame) const
+{
+	return frame.getArray() + getPacketHeaderLength(frame);
+}
+
+const uint8_t* PacketOperator::getPayloadArray(const IM920Frame& frame) const
+{
+	return frame.getArray() + getPacketHeaderLength(frame);
+}
+
+uint8_t* PacketOperator::getPayloadTerminator(IM920Frame& frame) const
+{
+	return frame.getTerminator();
+}
+
+const uint8_t* PacketOperator::getPayloadTerminator(const IM920Frame& frame) const
+{
+	return frame.getTerminator();
+}
+
+size_t PacketOperator::getPacketHeaderLength(const IM920Frame& frame) const
+{
+	return _headerLength(frame.getArray());
+}
+
+size_t PacketOperator::getMaxPayloadLength(const IM920Frame& frame) const
+{
+	return FRAME_PAYLOAD_SIZE - getPacketHeaderLength(frame);
+}
+
+uint8_t PacketOperator::getHeaderVersion(const IM920Frame& frame) const
+{
+	return PacketVersionField::get(frame.getArray());
+}
+
+size_t PacketOperator::getPacketLength(const IM920Frame& frame) const
+{
+	assert(frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
+
+	return PacketLengthField::get(frame.getArray());
+}
+
+int PacketOperator::getPacketType(const IM920Frame& frame) const
+{
+	assert(frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
+	
+	return PacketTypeField::get(frame.getArray());
+}
+
+bool PacketOperator::isFragmented(const IM920Frame& frame) const
+{
+	assert(frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
+	
+	return (frame.getArray()[IM920_PACKET_FLAG_I] & IM920_PACKET_FLAG_MASK_FRAG) != 0 ? true : false;
+}
+
+bool PacketOperator::isAckRequested(const IM920Frame& frame) const
+{
+	assert(frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
+
+	return (frame.getArray()[IM920_PACKET_FLAG_I] & IM920_PACKET_FLAG_MASK_ACK) != 0 ? true : false;
+}
+
+bool PacketOperator::isCompressed(const IM920Frame& frame) const
+{
+	int type = getPacketType(frame);
+
+	// the bit belongs to the FEC index in other packet types
+	if (type != IM920_PACKET_COMMAND && type != IM920_PACKET_ACK && type != IM920_PACKET_NOTICE) return false;
+
+	return (frame.getArray()[IM920_PACKET_FLAG_I] & IM920_PACKET_FLAG_MASK_DICT) != 0 ? true : false;
+}
+
+uint8_t PacketOperator::getFrameID(const IM920Frame& frame) const
+{
+	assert(frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
+
+	return PacketFrameIDField::get(frame.getArray());
+}
+
+uint16_t PacketOperator::getSequence(const IM920Frame& frame) const
+{
+	const uint8_t* a = frame.getArray();
+
+	// a v1 header only has the low byte
+	if (PacketVersionField::get(a) != IM920_PACKET_VERSION_2) return PacketFrameIDField::get(a);
+
+	return ((uint16_t)PacketSeqHighField::get(a) << 8) | PacketFrameIDField::get(a);
+}
+
+uint8_t PacketOperator::getStreamID(const IM920Frame& frame) const
+{
+	const uint8_t* a = frame.getArray();
+
+	if (PacketVersionField::get(a) != IM920_PACKET_VERSION_2) return 0;
+
+	return PacketStreamField::get(a);
+}
+
+void PacketOperator::setPacketLength(IM920Frame& frame, size_t length) const
+{
+	assert(frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
+	
+	PacketLengthField::set(frame.getArray(), length);
+}
+
+void PacketOperator::setPacketType(IM920Frame& frame, uint8_t type) const
+{
+	assert (frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
+
+	PacketTypeField::set(frame.getArray(), type);
+}
+
+void PacketOperator::setFragment(IM920Frame& frame, bool fragment) const
+{
+	if (fragment) frame.getArray()[IM920_PACKET_FLAG_I] |= IM920_PACKET_FLAG_MASK_FRAG;
+	else frame.getArray()[IM920_PACKET_FLAG_I] &= ~IM920_PACKET_FLAG_MASK_FRAG;
+}
+
+void PacketOperator::setAckRequest(IM920Frame& frame, bool request) const
+{
+	if (request) frame.getArray()[IM920_PACKET_FLAG_I] |= IM920_PACKET_FLAG_MASK_ACK;
+	else frame.getArray()[IM920_PACKET_FLAG_I] &= ~IM920_PACKET_FLAG_MASK_ACK;
+}
+
+void PacketOperator::setFrameID(IM920Frame& frame, uint8_t num) const
+{
+	PacketFrameIDField::set(frame.getArray(), num);
+}
+
+void PacketOperator::setSequence(IM920Frame& frame, uint16_t num) const
+{
+	uint8_t* a = frame.getArray();
+
+	PacketFrameIDField::set(a, num);
+	if (PacketVersionField::get(a) == IM920_PACKET_VERSION_2) PacketSeqHighField::set(a, num >> 8);
+}
+
+bool PacketOperator::setStreamID(IM920Frame& frame, uint8_t stream) const
+{
+	uint8_t* a = frame.getArray();
+
+	if (PacketVersionField::get(a) != IM920_PACKET_VERSION_2) {
+		// widen the header in place, keeping the payload
+		size_t length = getPayloadLength(frame);
+
+		if (length > FRAME_PAYLOAD_SIZE - IM920_PACKET_HEADER_V2_SIZE) return false;
+
+		memmove(a + IM920_PACKET_HEADER_V2_SIZE, a + IM920_PACKET_HEADER_SIZE, length);
+		PacketSeqHighField::set(a, 0);
+		PacketVersionField::set(a, IM920_PACKET_VERSION_2);
+		frame.resetFrameLength(IM920_PACKET_HEADER_V2_SIZE + length);
+	}
+
+	PacketStreamField::set(a, stream);
+
+	return true;
+}
+
+void PacketOperator::updatePacketLength(IM920Frame& frame) const
+{
+	size_t length;
+	
+	length = getPayloadLength(frame);
+	
+	setPacketLength(frame, length);
+}
+
+AckPacket::AckPacket()
+{
+}
+
+AckPacket::~AckPacket()
+{
+}
+
+AckPacket& AckPacket::Instance()
+{
+	if (_instance == nullptr) {
+		_instance = new AckPacket();
+	}
+
+	return *_instance;
+}
+
+void AckPacket::reset(IM920Frame& frame, size_t size) const
+{
+	PacketOperator::reset(frame, size);
+
+	setPacketType(frame, IM920_PACKET_ACK);
+}
+
+uint8_t AckPacket::getCommand(const IM920Frame& frame) const
+{
+	return getPayloadArray(frame)[IM920_PACKET_ACK_CMD_I];
+}
+
+void AckPacket::setCommand(IM920Frame& frame, uint8_t cmd) const
+{
+	getPayloadArray(frame)[IM920_PACKET_ACK_CMD_I] = cmd;
+}
+
+size_t AckPacket::getResponseLength(const IM920Frame& frame) const
+{
+	assert( strlen( reinterpret_cast<const char*>(getPayloadArray(frame) + IM920_PACKET_ACK_PARAM_I)) == (getPacketLength(frame) - ACK_COMMAND_SIZE));
+
+	return getPacketLength(frame) - ACK_COMMAND_SIZE;
+}
+
+size_t AckPacket::getResponse(const IM920Frame& frame, char buf[], size_t size) const
+{
+	const char* param = reinterpret_cast<const char*>( getPayloadArray(frame) + IM920_PACKET_ACK_PARAM_I);
+	size_t len = getResponseLength(frame);
+	
+	if (size < len + 1)
+		len = size - 1;
+
+	// '\0' character is not copied.
+	strncpy(buf, param, len);
+	buf[len] = '\0';
+	
+	return len;
+}
+
+const char* AckPacket::getResponse(const IM920Frame& frame) const
+{
+	return reinterpret_cast<const char*>(getPayloadArray(frame) + IM920_PACKET_ACK_PARAM_I);
+}
+
+size_t AckPacket::setResponse(IM920Frame& frame, const char response[]) const
+{
+	size_t responseLen = strlen(response);
+
+	if (responseLen > ACK_PARAM_LEN) responseLen = ACK_PARAM_LEN;
+	
+	resetPayloadLength(frame, responseLen + ACK_COMMAND_SIZE);
+	
+	char* buf = reinterpret_cast<char*>(getPayloadArray(frame) + IM920_PACKET_ACK_PARAM_I);
+	strncpy(buf, response, responseLen);
+	buf[responseLen] = '\0';
+	
+	updatePacketLength(frame);
+	
+	return responseLen;
+}
+
+CommandPacket::CommandPacket()
+{
+}
+
+CommandPacket::~CommandPacket()
+{
+}
+
+CommandPacket& CommandPacket::Instance()
+{
+	if (_instance == nullptr) {
+		_instance = new CommandPacket();
+	}
+
+	return *_instance;
+}
+
+void CommandPacket::reset(IM920Frame& frame, size_t size) const
+{
+	PacketOperator::reset(frame, size);
+
+	setPacketType(frame, IM920_PACKET_COMMAND);
+}
+
+uint8_t CommandPacket::getCommand(const IM920Frame& frame) const
+{
+	return getPayloadArray(frame)[IM920_PACKET_COMMAND_CMD_I];
+}
+
+void CommandPacket::setCommand(IM920Frame& frame, uint8_t cmd) const
+{
+	getPayloadArray(frame)[IM920_PACKET_COMMAND_CMD_I] = cmd;
+}
+
+size_t CommandPacket::getCommandParamLength(const IM920Frame& frame) const
+{
+	assert(strlen(reinterpret_cast<const char*>(getPayloadArray(frame) + IM920_PACKET_COMMAND_PARAM_I)) == (getPacketLength(frame) - COMMAND_SIZE));
+
+	return getPacketLength(frame) - COMMAND_SIZE;
+}
+
+size_t CommandPacket::getCommandParam(const IM920Frame& frame, char buf[], size_t size) const
+{
+	const char* param = reinterpret_cast<const char*>(getPayloadArray(frame) + IM920_PACKET_COMMAND_PARAM_I);
+	size_t len = getCommandParamLength(frame);
+	
+	if (size < len + 1)
+		len = size;
+
+	strncpy(buf, param, len);
+	buf[len] = '\0';
+
+	return len;
+}
+
+const char* CommandPacket::getCommandParam(const IM920Frame& frame) const
+{
+	return reinterpret_cast<const char*>(getPayloadArray(frame) + IM920_PACKET_COMMAND_PARAM_I);
+}
+
+size_t CommandPacket::setCommandParam(IM920Frame& frame, const char param[]) const
+{
+	size_t paramLen = strlen(param);
+
+	if (paramLen > COMMAND_PARAM_LEN) paramLen = COMMAND_PARAM_LEN;
+	
+	resetPayloadLength(frame, paramLen + COMMAND_SIZE);
+	
+	char* buf = reinterpret_cast<char*>(getPayloadArray(frame) + IM920_PACKET_COMMAND_PARAM_I);
+	strncpy(buf, param, paramLen);
+	buf[paramLen] = '\0';
+	
+	updatePacketLength(frame);
+	
+	return paramLen;
+}
+
+DataPacket::DataPacket()
+{
+}
+
+DataPacket::~DataPacket()
+{
+}
+
+DataPacket& DataPacket::Instance()
+{
+	if (_instance == nullptr) {
+		_instance = new DataPacket();
+	}
+	
+	return *_instance;
+}
+
+void DataPacket::reset(IM920Frame& frame, size_t size) const
+{
+	PacketOperator::reset(frame, size);
+
+	setPacketType(frame, IM920_PACKET_DATA);
+}
+
+size_t DataPacket::getDataLength(const IM920Frame& frame) const
+{
+	assert(getPacketLength(frame) == (getPayloadTerminator(frame) - getPayloadArray(frame)));
+
+	return getPacketLength(frame);
+}
+
+size_t DataPacket::getData(const IM920Frame& frame, uint8_t buf[], size_t size) const
+{
+	size_t length = getDataLength(frame);
+
+	if (size < length)
+		length = size;
+
+	memcpy(buf, getPayloadArray(frame), length);
+	
+	return length;
+}
+
+const uint8_t* DataPacket::getData(const IM920Frame& frame) const
+{
+	return getPayloadArray(frame);
+}
+
+size_t DataPacket::setData(IM920Frame& frame, const uint8_t data[], size_t length) const
+{
+	uint8_t* buf = getPayloadArray(frame);
+	
+	if (length > getMaxPayloadLength(frame)) length = getMaxPayloadLength(frame);
+	
+	resetPayloadLength(frame, length);
+	
+	memcpy(buf, data, length);
+	
+	updatePacketLength(frame);
+	
+	return length;
+}
+
+size_t DataPacket::setData(IM920Frame& frame, const IM920Segment segments[], size_t count, size_t offset, size_t length) const
+{
+	uint8_t* buf = getPayloadArray(frame);
+	size_t copied = 0;
+
+	if (length > getMaxPayloadLength(frame)) length = getMaxPayloadLength(frame);
+
+	// gather straight from the caller's buffers, starting at the offset into their concatenation
+	for (size_t i = 0; i < count && copied < length; i++) {
+		if (offset >= segments[i].length) {
+			offset -= segments[i].length;
+			continue;
+		}
+
+		size_t n = segments[i].length - offset;
+		if (n > length - copied) n = length - copied;
+
+		memcpy(buf + copied, segments[i].data + offset, n);
+		copied += n;
+		offset = 0;
+	}
+
+	resetPayloadLength(frame, copied);
+
+	updatePacketLength(frame);
+
+	return copied;
+}
+
+uint8_t DataPacket::getFecIndex(const IM920Frame& frame) const
+{
+	assert(frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
+
+	return (frame.getArray()[IM920_PACKET_FEC_I] & IM920_PACKET_FEC_MASK) >> IM920_PACKET_FEC_SHIFT;
+}
+
+void DataPacket::setFecIndex(IM920Frame& frame, uint8_t index) const
+{
+	frame.getArray()[IM920_PACKET_FEC_I] &= ~IM920_PACKET_FEC_MASK;
+	frame.getArray()[IM920_PACKET_FEC_I] |= (index << IM920_PACKET_FEC_SHIFT) & IM920_PACKET_FEC_MASK;
+}
+
+ParityPacket::ParityPacket()
+{
+}
+
+ParityPacket::~ParityPacket()
+{
+}
+
+ParityPacket& ParityPacket::Instance()
+{
+	if (_instance == nullptr) {
+		_instance = new ParityPacket();
+	}
+
+	return *_instance;
+}
+
+void ParityPacket::reset(IM920Frame& frame, size_t size) const
+{
+	PacketOperator::reset(frame, size);
+
+	setPacketType(frame, IM920_PACKET_PARITY);
+}
+
+uint8_t ParityPacket::getGroupSize(const IM920Frame& frame) const
+{
+	return getPayloadArray(frame)[PARITY_GROUP_I];
+}
+
+TelemetryPacket::TelemetryPacket()
+{
+}
+
+TelemetryPacket::~TelemetryPacket()
+{
+}
+
+TelemetryPacket& TelemetryPacket::Instance()
+{
+	if (_instance == nullptr) {
+		_instance = new TelemetryPacket();
+	}
+
+	return *_instance;
+}
+
+void TelemetryPacket::reset(IM920Frame& frame, size_t size) const
+{
+	PacketOperator::reset(frame, size);
+
+	setPacketType(frame, IM920_PACKET_TELEMETRY);
+}
+
+uint8_t TelemetryPacket::getGeneration(const IM920Frame& frame) const
+{
+	return getPayloadArray(frame)[TELEMETRY_GENERATION_I];
+}
+
+uint8_t TelemetryPacket::getReference(const IM920Frame& frame) const
+{
+	return getPayloadArray(frame)[TELEMETRY_REFERENCE_I];
+}
+
+bool TelemetryPacket::isKeyframe(const IM920Frame& frame) const
+{
+	return (getPayloadArray(frame)[TELEMETRY_COUNT_I] & TELEMETRY_KEYFRAME) != 0;
+}
+
+uint8_t TelemetryPacket::getSampleCount(const IM920Frame& frame) const
+{
+	return getPayloadArray(frame)[TELEMETRY_COUNT_I] & TELEMETRY_COUNT_MASK;
+}
+
+NoticePacket::NoticePacket()
+{
+}
+
+NoticePacket::~NoticePacket()
+{
+}
+
+NoticePacket& NoticePacket::Instance()
+{
+	if (_instance == nullptr) {
+		_instance = new NoticePacket();
+	}
+
+	return *_instance;
+}
+
+void NoticePacket::reset(IM920Frame& frame, size_t size) const
+{
+	PacketOperator::reset(frame, size);
+
+	setPacketType(frame, IM920_PACKET_NOTICE);
+}
+
+size_t NoticePacket::getNoticeLength(const IM920Frame& frame) const
+{
+	assert(strlen(reinterpret_cast<const char*>(getPayloadArray(frame))) == (getPacketLength(frame)));
+
+	return getPacketLength(frame);
+}
+
+size_t NoticePacket::getNotice(const IM920Frame& frame, char buf[], size_t size) const
+{
+	const char* notice = reinterpret_cast<const char*>(getPayloadArray(frame));
+	size_t len = getNoticeLength(frame);
+	
+	if (size < len + 1)
+		len = size - 1;
+
+	strncpy(buf, notice, len);
+	buf[len] = '\0';
+
+	return len;
+}
+
+const char* NoticePacket::getNotice(const IM920Frame& frame) const
+{
+	return reinterpret_cast<const char*>(getPayloadArray(frame));
+}
+
+size_t NoticePacket::setNotice(IM920Frame& frame, const char notice[]) const
+{
+	size_t noticeLen = strlen(notice);
+
+	if (noticeLen > NOTICE_MAX_LEN) noticeLen = NOTICE_MAX_LEN;
+	
+	resetPayloadLength(frame, noticeLen);
+	
+	char* buf = reinterpret_cast<char*>(getPayloadArray(frame));
+	strncpy(buf, notice, noticeLen);
+	buf[noticeLen] = '\0';
+	
+	updatePacketLength(frame);
+	
+	return noticeLen;
+}
+
+uint16_t NoticePacket::getTopicHash(const char topic[])
+{
+	// 32-bit FNV-1a folded down to the 14 bits a topic notice carries
+	uint32_t hash = 2166136261UL;
+
+	while (*topic != '\0') {
+		hash ^= (uint8_t)*topic++;
+		hash *= 16777619UL;
+	}
+
+	return (hash ^ (hash >> 14) ^ (hash >> 28)) & 0x3FFF;
+}
+
+bool NoticePacket::hasTopic(const IM920Frame& frame) const
+{
+	assert(frame.getFrameLength() >= IM920_PACKET_HEADER_SIZE);
+
+	if (getPacketType(frame) != IM920_PACKET_NOTICE) return false;
+
+	return (frame.getArray()[IM920_PACKET_FLAG_I] & IM920_PACKET_FLAG_MASK_TOPIC) != 0 ? true : false;
+}
+
+uint16_t NoticePacket::getTopic(const IM920Frame& frame) const
+{
+	const uint8_t* buf = getPayloadArray(frame) + NOTICE_TOPIC_I;
+
+	if (!hasTopic(frame) || getPayloadLength(frame) < IM920_TOPIC_SIZE) return IM920_TOPIC_NONE;
+
+	return ((buf[0] & 0x7F) << 7) | (buf[1] & 0x7F);
+}
+
+const char* NoticePacket::getMessage(const IM920Frame& frame) const
+{
+	if (!hasTopic(frame)) return getNotice(frame);
+
+	return reinterpret_cast<const char*>(getPayloadArray(frame) + IM920_TOPIC_SIZE);
+}
+
+size_t NoticePacket::setNotice(IM920Frame& frame, const char topic[], const char notice[]) const
+{
+	size_t noticeLen = strlen(notice);
+	uint16_t hash = getTopicHash(topic);
+
+	if (noticeLen > TOPIC_MAX_LEN) noticeLen = TOPIC_MAX_LEN;
+
+	resetPayloadLength(frame, noticeLen + IM920_TOPIC_SIZE);
+
+	// the topic bytes keep the high bit set so that the notice stays a valid string
+	uint8_t* buf = getPayloadArray(frame);
+	buf[NOTICE_TOPIC_I] = 0x80 | (hash >> 7);
+	buf[NOTICE_TOPIC_I + 1] = 0x80 | (hash & 0x7F);
+	strncpy(reinterpret_cast<char*>(buf + IM920_TOPIC_SIZE), notice, noticeLen);
+	buf[IM920_TOPIC_SIZE + noticeLen] = '\0';
+
+	frame.getArray()[IM920_PACKET_FLAG_I] |= IM920_PACKET_FLAG_MASK_TOPIC;
+
+	updatePacketLength(frame);
+
+	return noticeLen;
+}
+
+#if IM920_DICTIONARY
+size_t IM920Dictionary::encode(const uint8_t src[], size_t length, uint8_t dst[], size_t size)
+{
+	size_t n = 0;
+	size_t i = 0;
+
+	while (i < length)
+	{
+		// codes take the range above ASCII, so only plain text can be encoded
+		if (src[i] & IM920_DICTIONARY_CODE) return 0;
+		if (n >= size) return 0;
+
+		uint8_t best = 0;
+		size_t bestLength = 1;
+
+		// the longest token wins
+		for (uint8_t t = 0; t < IM920_DICTIONARY_SIZE; t++) {
+			const char* token = IM920_DICTIONARY_TOKENS[t];
+			size_t len = 0;
+			char c;
+
+			while ((c = pgm_read_byte(&token[len])) != '\0' && i + len < length && src[i + len] == (uint8_t)c) len++;
+
+			if (c == '\0' && len > bestLength) {
+				best = t;
+				bestLength = len;
+			}
+		}
+
+		dst[n++] = bestLength > 1 ? IM920_DICTIONARY_CODE | best : src[i];
+		i += bestLength;
+	}
+
+	return n;
+}
+
+int IM920Dictionary::decode(const uint8_t src[], size_t length, uint8_t dst[], size_t size)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < length; i++) {
+		if (!(src[i] & IM920_DICTIONARY_CODE)) {
+			if (n >= size) return -1;
+
+			dst[n++] = src[i];
+			continue;
+		}
+
+		uint8_t t = src[i] & ~IM920_DICTIONARY_CODE;
+
+		// a code from a newer table cannot be expanded
+		if (t >= IM920_DICTIONARY_SIZE) return -1;
+
+		const char* token = IM920_DICTIONARY_TOKENS[t];
+		char c;
+
+		for (size_t j = 0; (c = pgm_read_byte(&token[j])) != '\0'; j++) {
+			if (n >= size) return -1;
+
+			dst[n++] = c;
+		}
+	}
+
+	return n;
+}
+#endif
+
+IM920TxQueue::IM920TxQueue()
+	: _used(0), _marked(0), _marking(false)
+{
+	for (int i = 0; i < IM920_TX_CLASSES; i++) {
+		_head[i] = 0;
+		_count[i] = 0;
+		_weight[i] = 0;
+		_credit[i] = 0;
+	}
+}
+
+IM920TxQueue::~IM920TxQueue()
+{
+}
+
+IM920Frame* IM920TxQueue::reserve()
+{
+	// a reserved frame stays free until it is committed
+	for (int i = 0; i < IM920_TX_QUEUE_SIZE; i++) {
+		if (!(_used & (1 << i))) return &_frames[i];
+	}
+
+	return nullptr;
+}
+
+void IM920TxQueue::commit(IM920Frame* frame, uint8_t priority)
+{
+	uint8_t i = frame - _frames;
+
+	assert(i < IM920_TX_QUEUE_SIZE && priority < IM920_TX_CLASSES);
+
+	_fifo[priority][(_head[priority] + _count[priority]) % IM920_TX_QUEUE_SIZE] = i;
+	_count[priority]++;
+	_used |= (1 << i);
+	if (_marking) _marked |= (1 << i);
+}
+
+IM920Frame* IM920TxQueue::peek()
+{
+	uint8_t priority = _select();
+
+	if (priority == IM920_TX_NONE) return nullptr;
+
+	return &_frames[_fifo[priority][_head[priority]]];
+}
+
+IM920Frame* IM920TxQueue::take()
+{
+	uint8_t priority = _select();
+	uint8_t i;
+
+	if (priority == IM920_TX_NONE) return nullptr;
+
+	if (_credit[priority] > 0) _credit[priority]--;
+
+	// once a lower class has had its turn, the classes above it get their full share again
+	for (uint8_t j = 0; j < priority; j++) _credit[j] = _weight[j];
+
+	// the frame leaves its FIFO but stays allocated until it is released
+	i = _fifo[priority][_head[priority]];
+	_head[priority] = (_head[priority] + 1) % IM920_TX_QUEUE_SIZE;
+	_count[priority]--;
+
+	return &_frames[i];
+}
+
+void IM920TxQueue::release(IM920Frame* frame)
+{
+	uint8_t i = frame - _frames;
+
+	assert(i < IM920_TX_QUEUE_SIZE);
+
+	_used &= ~(1 << i);
+	_marked &= ~(1 << i);
+}
+
+size_t IM920TxQueue::count(uint8_t priority) const
+{
+	return _count[priority];
+}
+
+bool IM920TxQueue::isFull() const
+{
+	return _used == (1 << IM920_TX_QUEUE_SIZE) - 1;
+}
+
+bool IM920TxQueue::setMarking(bool marking)
+{
+	bool previous = _marking;
+
+	_marking = marking;
+
+	return previous;
+}
+
+bool IM920TxQueue::isMarked(const IM920Frame* frame) const
+{
+	uint8_t i = frame - _frames;
+
+	return i < IM920_TX_QUEUE_SIZE && (_marked & (1 << i));
+}
+
+size_t IM920TxQueue::getFreeCount() const
+{
+	size_t count = 0;
+
+	for (int i = 0; i < IM920_TX_QUEUE_SIZE; i++) {
+		if (!(_used & (1 << i))) count++;
+	}
+
+	return count;
+}
+
+void IM920TxQueue::setWeight(uint8_t priority, uint8_t weight)
+{
+	_weight[priority] = weight;
+	_credit[priority] = weight;
+}
+
+uint8_t IM920TxQueue::getPriority(const IM920Frame& frame)
+{
+	switch (PacketOperator::refInstance(frame).getPacketType(frame))
+	{
+		case IM920_PACKET_COMMAND:
+			return IM920_TX_CONTROL;
+
+		case IM920_PACKET_ACK:
+			return IM920_TX_ACK;
+
+		case IM920_PACKET_NOTICE:
+			return IM920_TX_NOTICE;
+
+		default:
+			return IM920_TX_BULK;
+	}
+}
+
+uint8_t IM920TxQueue::_select()
+{
+	// classes are served in strict priority order. A class with a non-zero weight may send
+	// only that many frames in a row while lower classes are waiting; take() restores its
+	// share after a lower class was served.
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < IM920_TX_CLASSES; i++) {
+			if (_count[i] == 0) continue;
+			if (_weight[i] == 0 || _credit[i] > 0) return i;
+		}
+
+		// every waiting class has used up its share
+		for (int i = 0; i < IM920_TX_CLASSES; i++) _credit[i] = _weight[i];
+	}
+
+	return IM920_TX_NONE;
+}
+
+IM920Frame::IM920Frame()
+	: _p(0), _rp(0)
+{
+	// +1 is for '\0' char
+	for (int i = 0; i < FRAME_PAYLOAD_SIZE + 1; i++) _payload[i] = 0;
+}
+
+IM920Frame::~IM920Frame()
+{
+}
+
+size_t IM920Frame::put(uint8_t data)
+{
+	if (!(_p < FRAME_PAYLOAD_SIZE)) return 0;
+
+	_payload[_p++] = data;
+
+	return _p;
+}
+
+uint8_t IM920Frame::getNextByte()
+{
+	if (!(_rp < _p)) return 0;
+
+	return _payload[_rp++];
+}
+
+void IM920Frame::clear()
+{
+	_p = 0;
+	_rp = 0;
+	for (int i = 0; i < FRAME_PAYLOAD_SIZE + 1; i++) _payload[i] = 0;
+}
+
+size_t IM920Frame::resetFrameLength(size_t length)
+{
+	assert(length <= FRAME_PAYLOAD_SIZE);
+
+	if (length > FRAME_PAYLOAD_SIZE) {
+		_p = FRAME_PAYLOAD_SIZE;
+		return _p;
+	}
+	
+	_p = length;
+
+	if (_p < _rp) _rp = _p;
+
+	return _p;
+}
+
+IM920TimeSync::IM920TimeSync()
+	: _interval(0), _lastBeacon(0), _synchronized(false), _baseLocal(0), _baseOffset(0), _drift(0), _slot(0), _slotCount(0), _slotLength(0)
+{
+}
+
+IM920TimeSync::~IM920TimeSync()
+{
+}
+
+void IM920TimeSync::setMaster(unsigned long interval)
+{
+	_interval = interval;
+	_lastBeacon = millis() - interval;
+
+	// the master is the reference of the network time
+	_synchronized = interval > 0;
+	_baseOffset = 0;
+	_drift = 0;
+}
+
+void IM920TimeSync::update(unsigned long remote, unsigned long local)
+{
+	long offset = (long)(remote - local);
+
+	if (_synchronized) {
+		long elapsed = (long)(local - _baseLocal);
+
+		if (elapsed > 0) {
+			// drift in units of 2^-24 ms per ms, averaged with a weight of 1/4 for the new sample
+			long long rate = ((long long)(offset - _baseOffset) << 24) / elapsed;
+
+			_drift += (long)((rate - _drift) / 4);
+		}
+	}
+
+	_baseLocal = local;
+	_baseOffset = offset;
+	_synchronized = true;
+}
+
+unsigned long IM920TimeSync::now() const
+{
+	unsigned long local = millis();
+
+	if (!_synchronized) return local;
+
+	long elapsed = (long)(local - _baseLocal);
+
+	return local + _baseOffset + (long)(((long long)elapsed * _drift) >> 24);
+}
+
+bool IM920TimeSync::pollBeacon()
+{
+	if (!isMaster() || millis() - _lastBeacon < _interval) return false;
+
+	_lastBeacon = millis();
+
+	return true;
+}
+
+void IM920TimeSync::setSlot(uint8_t slot, uint8_t slotCount, uint16_t slotLength)
+{
+	_slot = slot;
+	_slotCount = slotCount;
+	_slotLength = slotLength;
+}
+
+unsigned long IM920TimeSync::getSlotWait(unsigned long airTime) const
+{
+	// without a schedule or a synchronized clock every node transmits at will
+	if (_slotCount == 0 || !_synchronized) return 0;
+	if (!_slotLength) return 0;
+
+	unsigned long frame = (unsigned long)_slotCount * _slotLength;
+	unsigned long position = now() % frame;
+	unsigned long start = (unsigned long)_slot * _slotLength;
+
+	if (position >= start && position + airTime + IM920_SLOT_GUARD <= start + _slotLength) return 0;
+
+	return (start + frame - position) % frame;
+}
+
+bool IM920TimeSync::fitsSlot(unsigned long airTime) const
+{
+	if (_slotCount == 0 || !_synchronized) return true;
+	if (!_slotLength) return true;
+
+	return airTime + IM920_SLOT_GUARD <= _slotLength;
+}
+
+IM920RateLimiter::IM920RateLimiter()
+	: _bitRate(IM920_AIR_BITRATE_FAST), _pause(IM920_TX_PAUSE), _previous(millis()), _next(_previous)
+{
+	setDutyLimit(IM920_DUTY_WINDOW, IM920_DUTY_BUDGET);
+}
+
+IM920RateLimiter::~IM920RateLimiter()
+{
+}
+
+void IM920RateLimiter::setBitRate(unsigned long bitRate)
+{
+	_bitRate = bitRate;
+}
+
+void IM920RateLimiter::setDutyLimit(unsigned long window, unsigned long budget)
+{
+	_window = window;
+	// the bucket is kept in microseconds of airtime and refilled every millisecond
+	_capacity = budget * 1000;
+	_refill = window > 0 ? _capacity / window : 0;
+	_tokens = _capacity;
+	_previous = millis();
+}
+
+void IM920RateLimiter::setPause(unsigned long pause)
+{
+	_pause = pause;
+}
+
+unsigned long IM920RateLimiter::getAirTime(size_t length) const
+{
+	unsigned long bits = (length + IM920_AIR_OVERHEAD_BYTES) << 3;
+
+	return (bits * 1000000UL + _bitRate - 1) / _bitRate;
+}
+
+unsigned long IM920RateLimiter::getWaitTime(size_t length)
+{
+	unsigned long wait = 0;
+	unsigned long current = millis();
+
+	_update();
+
+	if ((long)(_next - current) > 0) wait = _next - current;
+
+	if (_refill > 0) {
+		unsigned long airTime = getAirTime(length);
+
+		if (_tokens < airTime) {
+			unsigned long refillTime = (airTime - _tokens + _refill - 1) / _refill;
+			if (refillTime > wait) wait = refillTime;
+		}
+	}
+
+	return wait;
+}
+
+void IM920RateLimiter::consume(size_t length)
+{
+	unsigned long airTime = getAirTime(length);
+
+	_update();
+
+	_tokens = _tokens > airTime ? _tokens - airTime : 0;
+	_next = millis() + (airTime + 999) / 1000 + _pause;
+}
+
+void IM920RateLimiter::_update()
+{
+	unsigned long current = millis();
+	unsigned long elapsed = current - _previous;
+
+	_previous = current;
+
+	if (_refill == 0) return;
+
+	if (elapsed > _window) elapsed = _window;
+	_tokens += elapsed * _refill;
+	if (_tokens > _capacity) _tokens = _capacity;
+}
+
+IM920LinkEstimator::IM920LinkEstimator()
+	: _loss(0), _length(FRAME_PAYLOAD_SIZE), _rssi(0xFF), _marginalRSSI(0)
+{
+}
+
+IM920LinkEstimator::~IM920LinkEstimator()
+{
+}
+
+void IM920LinkEstimator::update(size_t frameLength, bool lost)
+{
+	// exponentially weighted averages with a weight of 1/8 for the new sample
+	long sample = lost ? 0xFFFF : 0;
+
+	_loss += (sample - (long)_loss) / 8;
+	_length += ((long)frameLength - (long)_length) / 8;
+}
+
+void IM920LinkEstimator::updateRSSI(uint8_t rssi)
+{
+	_rssi += ((int)rssi - (int)_rssi) / 8;
+}
+
+void IM920LinkEstimator::setMarginalRSSI(uint8_t rssi)
+{
+	_marginalRSSI = rssi;
+}
+
+size_t IM920LinkEstimator::getFragmentSize() const
+{
+	// byte error rate in units of 2^-24, derived from the frame loss at the observed frame length
+	uint16_t loss = _loss;
+	if (_rssi < _marginalRSSI && loss < IM920_MARGINAL_LOSS) loss = IM920_MARGINAL_LOSS;
+
+	uint32_t byteError = ((uint32_t)loss << 8) / (_length + IM920_AIR_OVERHEAD_BYTES);
+	size_t best = DATA_PACKET_PAYLOAD_SIZE;
+	uint32_t bestGoodput = 0;
+
+	// goodput of a fragment is its payload share of the airtime times the chance it gets through
+	for (size_t size = IM920_FRAGMENT_MIN; size <= DATA_PACKET_PAYLOAD_SIZE; size++)
+	{
+		uint32_t air = size + IM920_PACKET_HEADER_SIZE + IM920_AIR_OVERHEAD_BYTES;
+		uint32_t error = byteError * air;
+		uint32_t success = error < (1UL << 24) ? ((1UL << 24) - error) >> 8 : 0;
+		uint32_t goodput = size * success / air;
+
+		if (goodput >= bestGoodput) {
+			bestGoodput = goodput;
+			best = size;
+		}
+	}
+
+	return best;
+}
+
+IM920Interface::IM920Interface()
+	: _resetPin(0), _busyPin(0), _activeTime(0), _sleepTime(0), _usTxTimePerByte(0), _initialized(false), _busySince(0), _timeout(1000), _serial(nullptr), _capture(nullptr), _captureTime(0)
+#if IM920_CAPTURE_LINE_SIZE > 0
+	, _captureLength(0), _captureSeen(false), _captureStart(0)
+#endif
+	, _op(IM920_OP_NONE), _txData(nullptr), _txLength(0), _txPos(0), _txMode(IM920_LINE_TEXT), _txChunked(false), _responseLen(0), _skipLine(false), _deadline(0), _parseError(false), _waking(false), _wakeSince(0)
+#if IM920_RX_RING_SIZE > 0
+	, _rxHead(0), _rxTail(0), _externalPump(false)
+#endif
+{
+}
+
+IM920Interface::~IM920Interface()
+{
+}
+
+void IM920Interface::begin(Stream& serial, int resetPin, int busyPin, long baud)
+{
+	_resetPin = resetPin;
+	_busyPin = busyPin;
+	pinMode(resetPin, OUTPUT);
+	pinMode(busyPin, INPUT);
+
+	// release reset signal to enable the interface
+	digitalWrite(resetPin, HIGH);
+
+	_serial = &serial;
+
+	_usTxTimePerByte = (1000000 / baud + 1) << 3;
+	
+	_serial->setTimeout(_timeout);
+	_waking = false;
+
+#if IM920_RX_RING_SIZE > 0
+	_rxHead = 0;
+	_rxTail = 0;
+#endif
+	
+	// discard the interface start log, returning as soon as the module is ready
+	_waitReady();
+	
+	_initialized = true;
+}
+
+void IM920Interface::end()
+{
+	_initialized = false;
+}
+
+size_t IM920Interface::available()
+{
+	return _available();
+}
+
+uint8_t IM920Interface::read()
+{
+	int c = _readByte();
+
+	if (c >= 0) {
+		uint8_t data = c;
+		_recordRx(&data, 1);
+	}
+
+	return c;
+}
+
+size_t IM920Interface::readBytesUntil(char character, uint8_t buf[], size_t length)
+{
+	size_t ret;
+
+	ret = _readBytesUntil(character, reinterpret_cast<char*>(buf), length);
+	_recordRx(buf, ret);
+
+	return ret;
+}
+
+size_t IM920Interface::sendBytes(const uint8_t* data, size_t length)
+{
+	int ret;
+	char res[5];
+
+	if (length > FRAME_PAYLOAD_SIZE) length = FRAME_PAYLOAD_SIZE;
+
+	if (isPending()) return 0;
+
+	if (_beginLineWait(data, length, IM920_LINE_HEX) < 0) return 0;
+	while ((ret = pollResponse(res, sizeof(res))) == IM920_PENDING) _pumpIdle();
+	
+	if (ret < 0 || strncmp_P(res, IM920_RESPONSE_OK, 2) != 0) return 0;
+	
+	return length;
+}
+
+int IM920Interface::beginSendBytes(const uint8_t data[], size_t length)
+{
+	if (length > FRAME_PAYLOAD_SIZE) length = FRAME_PAYLOAD_SIZE;
+
+	return _beginLine(data, length, IM920_LINE_HEX);
+}
+
+int IM920Interface::beginCommand(const char command[])
+{
+	return _beginLine(reinterpret_cast<const uint8_t*>(command), strlen(command), IM920_LINE_TEXT);
+}
+
+int IM920Interface::pollResponse(char buf[], size_t length, bool routeData)
+{
+	if (_op == IM920_OP_WRITE) {
+		if (!_writeLine()) return IM920_PENDING;
+
+		_beginResponse();
+	}
+
+	if (_op != IM920_OP_RESPONSE) return -1;
+
+	while (_available() > 0)
+	{
+		// every byte is captured as it is consumed, skipped lines and the "NN," of a frame included
+		char c = read();
+
+		if (_skipLine) {
+			if (c == '\n') _skipLine = false;
+
+			continue;
+		}
+
+		if (c == '\n') {
+			buf[_responseLen] = '\0';
+			_op = IM920_OP_NONE;
+
+			return _responseLen;
+		}
+
+		// characters beyond the buffer are dropped
+		if (_responseLen < length - 1) buf[_responseLen++] = c;
+
+		// "NN," starts a received frame, which is handed to the frame parser or dropped
+		if (_responseLen == IM920_LINE_CLASS_LEN && buf[IM920_LINE_CLASS_LEN - 1] == ',') {
+			_responseLen = 0;
+
+			if (routeData) return IM920_DATA_LINE;
+
+			_skipLine = true;
+		}
+	}
+
+	buf[_responseLen] = '\0';
+
+	if ((long)(millis() - _deadline) >= 0) {
+		_op = IM920_OP_NONE;
+
+		return -1;
+	}
+
+	return IM920_PENDING;
+}
+
+void IM920Interface::_beginResponse()
+{
+	_op = IM920_OP_RESPONSE;
+	_responseLen = 0;
+	_skipLine = false;
+	_deadline = millis() + _timeout;
+}
+
+bool IM920Interface::isPending() const
+{
+	return _op != IM920_OP_NONE;
+}
+
+void IM920Interface::setTimeout(unsigned long timeout)
+{
+	_timeout = timeout;
 	
-	char* buf = reinterpret_cast<char*>(getPayloadArray(frame) + IM920_PACKET_ACK_PARAM_I);
-	strncpy(buf, response, responseLen);
-	buf[responseLen] = '\0';
+	_serial->setTimeout(_timeout);
+}
+
+int8_t IM920Interface::parseInt8()
+{
+	return _parseHex(2);
+}
+
+int16_t IM920Interface::parseInt16()
+{
+	return _parseHex(4);
+}
+
+int32_t IM920Interface::parseInt32()
+{
+	return _parseHex(8);
+}
+
+size_t IM920Interface::readHexList(uint8_t buf[], size_t count)
+{
+	char a[IM920_HEX_CHUNK * 3];
+	size_t ret = 0;
+
+	while (ret < count)
+	{
+		size_t n = count - ret;
+		if (n > IM920_HEX_CHUNK) n = IM920_HEX_CHUNK;
+
+		size_t len = _readBytes(a, n * 3);
+		_recordRx(reinterpret_cast<uint8_t*>(a), len);
+
+		size_t decoded = decodeHexList(a, len / 3, buf + ret);
+		ret += decoded;
+
+		if (len < n * 3 || decoded < n) {
+			_parseError = true;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+bool IM920Interface::checkParseError()
+{
+	bool ret = _parseError;
+
+	_parseError = false;
+
+	return ret;
+}
+
+size_t IM920Interface::decodeHexList(const char src[], size_t count, uint8_t dst[])
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		uint8_t high = _hexValue(src[1]);
+		uint8_t low = _hexValue(src[2]);
+
+		// any invalid digit has bits above the nibble set
+		if (src[0] != ',' || ((high | low) & 0xF0)) return i;
+
+		dst[i] = (high << 4) | low;
+		src += 3;
+	}
+
+	return count;
+}
+
+int IM920Interface::configure(const char* const commands[], size_t count)
+{
+	char buf[20];
+	int ret = 0;
+
+	if (isPending()) return -1;
+
+	// every command goes out as soon as the module is done with the previous one, without waiting for its answer
+	for (size_t i = 0; i < count; i++) {
+		unsigned long start = millis();
+
+		while (_isBusy())
+		{
+			_pumpIdle();
+
+			if (millis() - start >= IM920_BUSY_TIMEOUT) return -1;
+		}
+
+		_write(commands[i]);
+		_write("\r\n");
+		_serial->flush();
+
+		// BUSY rises once the module has taken the line; a short pulse may be missed, but then the answer is already coming
+		start = millis();
+		while (!_isBusy() && _available() == 0)
+		{
+			if (millis() - start >= IM920_BUSY_TIMEOUT) return -1;
+		}
+	}
+
+	// the answers come back in the order of the commands, received frames in between are dropped
+	for (size_t i = 0; i < count; i++) {
+		int len;
+
+		_beginResponse();
+		while ((len = pollResponse(buf, sizeof(buf))) == IM920_PENDING) _pumpIdle();
+
+		if (len < 0) return -1;
+
+		if (strncmp_P(buf, IM920_RESPONSE_OK, 2) != 0) ret = -1;
+	}
+
+	return ret;
+}
+
+size_t IM920Interface::execIM920Cmd(const char command[], char response[], size_t length)
+{
+	int ret;
+
+	if (isPending()) return 0;
 	
-	updatePacketLength(frame);
+	if (_beginLineWait(reinterpret_cast<const uint8_t*>(command), strlen(command), IM920_LINE_TEXT) < 0) return 0;
+	while ((ret = pollResponse(response, length)) == IM920_PENDING) _pumpIdle();
 	
-	return responseLen;
+	return ret < 0 ? 0 : ret;
+}
+
+unsigned long IM920Interface::getTxTimePerByte()
+{
+	return _usTxTimePerByte;
+}
+
+int IM920Interface::enableSleep()
+{
+	int ret;
+	
+	ret = _exec(PSTR("DSRX"), IM920_RESPONSE_OK, true);
+
+	return ret;
+}
+
+int IM920Interface::disableSleep()
+{
+	int ret;
+
+	_write("?");
+	_serial->flush();
+	delayMicroseconds(_usTxTimePerByte);
+
+	ret = _exec(PSTR("ENRX"), IM920_RESPONSE_OK, true);
+
+	return ret;
+}
+
+int IM920Interface::beginSleep()
+{
+	return _beginLine(reinterpret_cast<const uint8_t*>(IM920_COMMAND_DSRX), 4, IM920_LINE_TEXT_P);
+}
+
+int IM920Interface::beginWakeUp()
+{
+	if (_op != IM920_OP_NONE) return -1;
+
+	// the module needs a byte to wake up before it takes a command, sent once per attempt
+	if (!_waking || micros() - _wakeSince >= IM920_BUSY_TIMEOUT * 1000UL) {
+		_write("?");
+		_waking = true;
+		_wakeSince = micros();
+
+		return -1;
+	}
+
+	// ENRX follows once the byte has had time to leave the UART and rouse the module
+	if (micros() - _wakeSince < 2 * _usTxTimePerByte) return -1;
+
+	if (_beginLine(reinterpret_cast<const uint8_t*>(IM920_COMMAND_ENRX), 4, IM920_LINE_TEXT_P) < 0) return -1;
+
+	_waking = false;
+
+	return 0;
+}
+
+uint16_t IM920Interface::getActiveDuration()
+{
+	return _activeTime;
+}
+
+uint16_t IM920Interface::getSleepDuration()
+{
+	return _sleepTime;
+}
+
+void IM920Interface::setActiveDuration(uint16_t activeTime)
+{
+	int ret = 0;
+	char cmd[9];
+	
+	if (_activeTime != activeTime) {
+		_activeTime = activeTime;
+
+		snprintf_P(cmd, sizeof(cmd), PSTR("SWTM%04X"), _activeTime);
+		ret = _exec(cmd, IM920_RESPONSE_OK);
+	}
+	
+	return ret;
+}
+
+void IM920Interface::setSleepDuration(uint16_t sleepTime)
+{
+	int ret = 0;
+	char cmd[9];
+	
+	if (_sleepTime != sleepTime) {
+		_sleepTime = sleepTime;
+		
+		snprintf_P(cmd, sizeof(cmd), PSTR("SSTM%04X"), _sleepTime);
+		ret = _exec(cmd, IM920_RESPONSE_OK);
+	}
+	
+	return ret;
+}
+
+int IM920Interface::resetInterface()
+{
+	int ret;
+	
+	ret = _exec(PSTR("SRST"), IM920_RESPONSE_BOOT, true);
+	
+	return ret;
+}
+
+void IM920Interface::setCapture(Print* capture)
+{
+	// a line still held goes to the previous destination
+	_flushCapture();
+
+	_capture = capture;
+
+#if IM920_CAPTURE_LINE_SIZE > 0
+	_captureSeen = false;
+#endif
+
+	if (_capture != nullptr) {
+		for (size_t i = 0; i < sizeof(IM920_CAPTURE_MAGIC) - 1; i++) _capture->write(pgm_read_byte(&IM920_CAPTURE_MAGIC[i]));
+		_captureTime = millis();
+	}
+}
+
+int IM920Interface::_exec(const char cmd[], const char search[], bool flash)
+{
+	int ret = 0;
+	char buf[20];
+	uint8_t mode = flash ? IM920_LINE_TEXT_P : IM920_LINE_TEXT;
+
+	if (isPending()) return -1;
+	
+	// send the command once the module is ready for it
+	if (_beginLineWait(reinterpret_cast<const uint8_t*>(cmd), flash ? strlen_P(cmd) : strlen(cmd), mode) < 0) return -1;
+	
+	// check the response
+	while ((ret = pollResponse(buf, sizeof(buf))) == IM920_PENDING) _pumpIdle();
+	if (ret < 0) return -1;
+
+	ret = 0;
+	if (search != nullptr) strncmp_P(buf, search, strlen_P(search)) == 0 ? ret = 0 : ret = -1;
+	
+	return ret;
+}
+
+int IM920Interface::_beginLine(const uint8_t data[], size_t length, uint8_t mode)
+{
+	if (_op != IM920_OP_NONE || _isBusy()) return -1;
+
+	_txData = data;
+	_txLength = length;
+	_txMode = mode;
+	_txPos = 0;
+	// streams without a transmit buffer report no room and are written at once
+	_txChunked = _serial->availableForWrite() > 0;
+	_op = IM920_OP_WRITE;
+
+	// put out as much of the line as the transmit buffer takes right away
+	_writeLine();
+
+	return 0;
+}
+
+bool IM920Interface::_writeLine()
+{
+	char chunk[IM920_WRITE_CHUNK];
+	size_t lineLength = (_txMode == IM920_LINE_HEX ? 4 + (_txLength << 1) : _txLength) + 2;
+	size_t room = _txChunked ? _serial->availableForWrite() : lineLength;
+
+	while (_txPos < lineLength && room > 0)
+	{
+		size_t n = 0;
+
+		n = lineLength - _txPos;
+		if (n > sizeof(chunk)) n = sizeof(chunk);
+		if (n > room) n = room;
+
+		_fillLine(chunk, n);
+
+		_write(chunk, n);
+		room -= n;
+	}
+
+	return _txPos == lineLength;
+}
+
+void IM920Interface::_fillLine(char buf[], size_t length)
+{
+	size_t n = 0;
+	size_t end = 4 + ((size_t)_txLength << 1);
+
+	while (n < length)
+	{
+		size_t pos = _txPos;
+
+		if (_txMode == IM920_LINE_HEX && pos >= 4 && pos < end) {
+			// encode the body a byte at a time rather than a digit at a time
+			const uint8_t* data = _txData + ((pos - 4) >> 1);
+
+			if (pos & 1) {
+				buf[n++] = pgm_read_byte(&IM920_HEX_DIGIT[*data++ & 0x0F]);
+				pos++;
+			}
+
+			while (n + 1 < length && pos + 1 < end)
+			{
+				buf[n++] = pgm_read_byte(&IM920_HEX_DIGIT[*data >> 4]);
+				buf[n++] = pgm_read_byte(&IM920_HEX_DIGIT[*data++ & 0x0F]);
+				pos += 2;
+			}
+
+			if (pos != _txPos) {
+				_txPos = pos;
+				continue;
+			}
+		} else if (_txMode == IM920_LINE_TEXT && pos < _txLength) {
+			size_t run = _txLength - pos;
+			if (run > length - n) run = length - n;
+
+			memcpy(buf + n, _txData + pos, run);
+			n += run;
+			_txPos += run;
+			continue;
+		}
+
+		buf[n++] = _getLineChar(_txPos++);
+	}
+}
+
+char IM920Interface::_getLineChar(size_t pos) const
+{
+	if (_txMode != IM920_LINE_HEX) {
+		if (pos >= _txLength) return pgm_read_byte(&IM920_COMMAND_TERM[pos - _txLength]);
+		if (_txMode == IM920_LINE_TEXT_P) return pgm_read_byte(&_txData[pos]);
+		return _txData[pos];
+	}
+
+	if (pos < 4) return pgm_read_byte(&IM920_COMMAND_TXDA[pos]);
+	pos -= 4;
+
+	size_t body = (size_t)_txLength << 1;
+
+	if (pos < body) {
+		uint8_t data = _txData[pos >> 1];
+		return pgm_read_byte(&IM920_HEX_DIGIT[(pos & 1) ? data & 0x0F : data >> 4]);
+	}
+
+	return pgm_read_byte(&IM920_COMMAND_TERM[pos - body]);
 }
 
-CommandPacket::CommandPacket()
+uint32_t IM920Interface::_parseHex(size_t digits)
 {
+	char a[8];
+	uint32_t value = 0;
+	size_t len;
+
+	len = _readBytes(a, digits);
+	_recordRx(reinterpret_cast<uint8_t*>(a), len);
+
+	if (len < digits) _parseError = true;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		uint8_t nibble = _hexValue(a[i]);
+
+		if (nibble > 0x0F) {
+			_parseError = true;
+			nibble = 0;
+		}
+
+		value = (value << 4) | nibble;
+	}
+
+	return value;
 }
 
-CommandPacket::~CommandPacket()
+bool IM920Interface::_isBusy()
 {
+	bool busy = digitalRead(_busyPin);
+
+	// BUSY may have dropped between two high samples, so it counts as busy only since the last low one
+	if (!busy) _busySince = millis();
+
+	return busy;
 }
 
-CommandPacket& CommandPacket::Instance()
+int IM920Interface::_beginLineWait(const uint8_t data[], size_t length, uint8_t mode)
 {
-	if (_instance == nullptr) {
-		_instance = new CommandPacket();
+	unsigned long start = millis();
+
+	// a module that stays busy is given up on like one that does not answer
+	while (_beginLine(data, length, mode) < 0)
+	{
+		if (millis() - start >= _timeout) return -1;
+
+		_pumpIdle();
 	}
 
-	return *_instance;
+	return 0;
 }
 
-void CommandPacket::reset(IM920Frame& frame, size_t size) const
+unsigned long IM920Interface::getBusyTime()
 {
-	PacketOperator::reset(frame, size);
+	return _isBusy() ? millis() - _busySince : 0;
+}
 
-	setPacketType(frame, IM920_PACKET_COMMAND);
+bool IM920Interface::_waitReady()
+{
+	char buf[32];
+	size_t len = 0;
+	unsigned long start = millis();
+	unsigned long settled = 0;
+	bool booting = false;
+
+	while (millis() - start < IM920_BOOT_TIMEOUT)
+	{
+		int c = _readByte();
+
+		if (c < 0) {
+			// a module without a banner is ready once BUSY has been seen high and has stayed low for a while
+			if (_isBusy()) {
+				booting = true;
+				settled = millis();
+			} else if (booting && len == 0 && millis() - settled >= IM920_BOOT_SETTLE) {
+				return true;
+			}
+
+			continue;
+		}
+
+		if (c != '\n') {
+			if (len < sizeof(buf) - 1) buf[len++] = c;
+
+			continue;
+		}
+
+		buf[len] = '\0';
+		_recordRx(reinterpret_cast<uint8_t*>(buf), len);
+		_recordRx(reinterpret_cast<const uint8_t*>("\n"), 1);
+
+		if (strncmp_P(buf, IM920_RESPONSE_BOOT, strlen_P(IM920_RESPONSE_BOOT)) == 0) return true;
+
+		len = 0;
+	}
+
+	return false;
 }
 
-uint8_t CommandPacket::getCommand(const IM920Frame& frame) const
+void IM920Interface::_pumpIdle()
 {
-	return getPayloadArray(frame)[IM920_PACKET_COMMAND_CMD_I];
+#if IM920_RX_RING_SIZE > 0
+	// keep the UART drained while waiting, unless an interrupt feeds the ring
+	if (!_externalPump) pump();
+#endif
 }
 
-void CommandPacket::setCommand(IM920Frame& frame, uint8_t cmd) const
+int IM920Interface::_available()
 {
-	getPayloadArray(frame)[IM920_PACKET_COMMAND_CMD_I] = cmd;
+#if IM920_RX_RING_SIZE > 0
+	_pumpIdle();
+
+	int count = (uint16_t)(_loadHead() - _loadTail());
+#else
+	int count = _serial->available();
+#endif
+
+#if IM920_CAPTURE_LINE_SIZE > 0
+	_pollCapture(count);
+#endif
+
+	return count;
 }
 
-size_t CommandPacket::getCommandParamLength(const IM920Frame& frame) const
+int IM920Interface::_readByte()
 {
-	assert(strlen(reinterpret_cast<const char*>(getPayloadArray(frame) + IM920_PACKET_COMMAND_PARAM_I)) == (getPacketLength(frame) - COMMAND_SIZE));
+#if IM920_RX_RING_SIZE > 0
+	uint16_t tail = _loadTail();
 
-	return getPacketLength(frame) - COMMAND_SIZE;
+	if (tail == _loadHead()) {
+		_pumpIdle();
+
+		if (tail == _loadHead()) return -1;
+	}
+
+	uint8_t c = _rxRing[tail & (IM920_RX_RING_SIZE - 1)];
+	_storeTail(tail + 1);
+
+	return c;
+#else
+	return _serial->read();
+#endif
 }
 
-size_t CommandPacket::getCommandParam(const IM920Frame& frame, char buf[], size_t size) const
+size_t IM920Interface::_readBytes(char buf[], size_t length)
 {
-	const char* param = reinterpret_cast<const char*>(getPayloadArray(frame) + IM920_PACKET_COMMAND_PARAM_I);
-	size_t len = getCommandParamLength(frame);
-	
-	if (size < len + 1)
-		len = size;
+#if IM920_RX_RING_SIZE > 0
+	size_t n = 0;
+	unsigned long start = millis();
 
-	strncpy(buf, param, len);
-	buf[len] = '\0';
+	while (n < length)
+	{
+		size_t run = _readRun(buf + n, length - n, -1);
 
-	return len;
+		if (run > 0) {
+			n += run;
+			start = millis();
+		} else if (millis() - start >= _timeout) {
+			break;
+		}
+	}
+
+	return n;
+#else
+	return _serial->readBytes(buf, length);
+#endif
 }
 
-const char* CommandPacket::getCommandParam(const IM920Frame& frame) const
+size_t IM920Interface::_readBytesUntil(char terminator, char buf[], size_t length)
 {
-	return reinterpret_cast<const char*>(getPayloadArray(frame) + IM920_PACKET_COMMAND_PARAM_I);
+#if IM920_RX_RING_SIZE > 0
+	size_t n = 0;
+	unsigned long start = millis();
+
+	while (n < length)
+	{
+		uint16_t tail = _loadTail();
+		size_t run = _readRun(buf + n, length - n, terminator);
+
+		if (run > 0) {
+			n += run;
+			start = millis();
+
+			// the terminator is consumed but not stored
+			if ((uint16_t)(_loadTail() - tail) > run) break;
+		} else if (_loadTail() != tail) {
+			break;
+		} else if (millis() - start >= _timeout) {
+			break;
+		}
+	}
+
+	return n;
+#else
+	_serial->setTimeout(_timeout);
+
+	return _serial->readBytesUntil(terminator, buf, length);
+#endif
 }
 
-size_t CommandPacket::setCommandParam(IM920Frame& frame, const char param[]) const
+#if IM920_RX_RING_SIZE > 0
+size_t IM920Interface::_readRun(char buf[], size_t length, int terminator)
 {
-	size_t paramLen = strlen(param);
+	uint16_t tail = _loadTail();
+	uint16_t count = _loadHead() - tail;
 
-	if (paramLen > COMMAND_PARAM_LEN) paramLen = COMMAND_PARAM_LEN;
-	
-	resetPayloadLength(frame, paramLen + COMMAND_SIZE);
-	
-	char* buf = reinterpret_cast<char*>(getPayloadArray(frame) + IM920_PACKET_COMMAND_PARAM_I);
-	strncpy(buf, param, paramLen);
-	buf[paramLen] = '\0';
-	
-	updatePacketLength(frame);
-	
-	return paramLen;
+	if (count == 0) {
+		_pumpIdle();
+		count = _loadHead() - tail;
+	}
+
+	// one contiguous run, up to the wrap of the ring
+	uint16_t offset = tail & (IM920_RX_RING_SIZE - 1);
+	size_t run = IM920_RX_RING_SIZE - offset;
+	if (run > count) run = count;
+	if (run > length) run = length;
+
+	// bytes up to the published head are not touched by the producer
+	const char* src = reinterpret_cast<const char*>(const_cast<const uint8_t*>(_rxRing)) + offset;
+	size_t consumed = run;
+
+	if (terminator >= 0) {
+		const char* end = static_cast<const char*>(memchr(src, terminator, run));
+
+		if (end != nullptr) {
+			run = end - src;
+			consumed = run + 1;
+		}
+	}
+
+	memcpy(buf, src, run);
+	_storeTail(tail + consumed);
+
+	return run;
 }
 
-DataPacket::DataPacket()
+uint16_t IM920Interface::_loadHead() const
+{
+#if IM920_RING_ATOMIC
+	// pairs with the release in _storeHead(), so the bytes below the head are stored
+	return _rxHead.load(std::memory_order_acquire);
+#else
+#if defined(__AVR__)
+	// a 16-bit load takes two instructions, and pump() may run in between
+	if (_externalPump) {
+		uint8_t sreg = SREG;
+		cli();
+		uint16_t head = _rxHead;
+		SREG = sreg;
+
+		return head;
+	}
+#endif
+
+	return _rxHead;
+#endif
+}
+
+uint16_t IM920Interface::_loadTail() const
 {
+#if IM920_RING_ATOMIC
+	// pairs with the release in _storeTail(), so a slot is read before pump() reuses it
+	return _rxTail.load(std::memory_order_acquire);
+#else
+	// only the consumer writes the tail, and pump() reads it with interrupts off
+	return _rxTail;
+#endif
 }
 
-DataPacket::~DataPacket()
+void IM920Interface::_storeHead(uint16_t head)
 {
+#if IM920_RING_ATOMIC
+	_rxHead.store(head, std::memory_order_release);
+#else
+	_rxHead = head;
+#endif
 }
 
-DataPacket& DataPacket::Instance()
+void IM920Interface::_storeTail(uint16_t tail)
 {
-	if (_instance == nullptr) {
-		_instance = new DataPacket();
+#if IM920_RING_ATOMIC
+	_rxTail.store(tail, std::memory_order_release);
+#else
+#if defined(__AVR__)
+	if (_externalPump) {
+		uint8_t sreg = SREG;
+		cli();
+		_rxTail = tail;
+		SREG = sreg;
+
+		return;
 	}
-	
-	return *_instance;
+#endif
+
+	_rxTail = tail;
+#endif
 }
 
-void DataPacket::reset(IM920Frame& frame, size_t size) const
+void IM920Interface::pump()
 {
-	PacketOperator::reset(frame, size);
+	uint16_t head = _rxHead;
+	uint16_t room = IM920_RX_RING_SIZE - (uint16_t)(head - _loadTail());
+	int count = _serial->available();
 
-	setPacketType(frame, IM920_PACKET_DATA);
+	// ask the UART once and move what it holds in one go
+	if (count > room) count = room;
+
+	while (count-- > 0)
+	{
+		_rxRing[head & (IM920_RX_RING_SIZE - 1)] = _serial->read();
+
+		// the byte is published only after it is stored
+		_storeHead(++head);
+	}
 }
 
-size_t DataPacket::getDataLength(const IM920Frame& frame) const
+void IM920Interface::setExternalPump(bool external)
 {
-	assert(getPacketLength(frame) == (getPayloadTerminator(frame) - getPayloadArray(frame)));
+	_externalPump = external;
+}
+#endif
 
-	return getPacketLength(frame);
+size_t IM920Interface::_write(const char data[])
+{
+	return _write(data, strlen(data));
 }
 
-size_t DataPacket::getData(const IM920Frame& frame, uint8_t buf[], size_t size) const
+size_t IM920Interface::_write(const char data[], size_t length)
 {
-	size_t length = getDataLength(frame);
+	if (_capture != nullptr) {
+		// what was received before goes first
+		_flushCapture();
+		_record(IM920_CAPTURE_TX, reinterpret_cast<const uint8_t*>(data), length, millis());
+	}
 
-	if (size < length)
-		length = size;
+	return _serial->write(reinterpret_cast<const uint8_t*>(data), length);
+}
 
-	memcpy(buf, getPayloadArray(frame), length);
-	
-	return length;
+void IM920Interface::_record(uint8_t direction, const uint8_t data[], size_t length, unsigned long time)
+{
+	// a line seen before the previous record was written is put right after it
+	if ((long)(time - _captureTime) < 0) time = _captureTime;
+
+	unsigned long elapsed = time - _captureTime;
+	_captureTime = time;
+
+	// gaps longer than a record can hold are split into time-only records of zero length
+	while (elapsed > 0xFFFF) {
+		_capture->write(direction);
+		_capture->write(0xFF);
+		_capture->write(0xFF);
+		elapsed -= 0xFFFF;
+	}
+
+	do {
+		uint8_t len = length > IM920_CAPTURE_LENGTH_MASK ? IM920_CAPTURE_LENGTH_MASK : length;
+
+		_capture->write(direction | len);
+		_capture->write(elapsed & 0xFF);
+		_capture->write(elapsed >> 8);
+		_capture->write(data, len);
+
+		data += len;
+		length -= len;
+		elapsed = 0;
+	} while (length > 0);
 }
 
-const uint8_t* DataPacket::getData(const IM920Frame& frame) const
+void IM920Interface::_recordRx(const uint8_t data[], size_t length)
 {
-	return getPayloadArray(frame);
+	if (_capture == nullptr) return;
+
+#if IM920_CAPTURE_LINE_SIZE > 0
+	for (size_t i = 0; i < length; i++) {
+		_stampCapture();
+		_captureLine[_captureLength++] = data[i];
+
+		// one record per line or run, so that single bytes do not each carry a header
+		if (data[i] == '\n' || _captureLength == IM920_CAPTURE_LINE_SIZE) _flushCapture();
+	}
+#else
+	_record(IM920_CAPTURE_RX, data, length, millis());
+#endif
 }
 
-size_t DataPacket::setData(IM920Frame& frame, const uint8_t data[], size_t length) const
+void IM920Interface::_stampCapture()
 {
-	uint8_t* buf = getPayloadArray(frame);
-	
-	if (length > DATA_PACKET_PAYLOAD_SIZE) length = DATA_PACKET_PAYLOAD_SIZE;
-	
-	resetPayloadLength(frame, length);
-	
-	memcpy(buf, data, length);
-	
-	updatePacketLength(frame);
-	
-	return length;
+#if IM920_CAPTURE_LINE_SIZE > 0
+	if (_capture == nullptr || _captureSeen) return;
+
+	_captureStart = millis();
+	_captureSeen = true;
+#endif
 }
 
-NoticePacket::NoticePacket()
+#if IM920_CAPTURE_LINE_SIZE > 0
+void IM920Interface::_pollCapture(int count)
 {
+	if (_capture == nullptr) return;
+
+	// a record is stamped when its first byte is seen, not when the parser gets to it
+	if (count > 0) _stampCapture();
+
+	// a line the parser leaves unfinished is not held back for long
+	if (_captureLength > 0 && (count == 0 || millis() - _captureStart >= IM920_CAPTURE_HOLD)) _flushCapture();
 }
+#endif
 
-NoticePacket::~NoticePacket()
+void IM920Interface::_flushCapture()
 {
+#if IM920_CAPTURE_LINE_SIZE > 0
+	if (_capture == nullptr || _captureLength == 0) return;
+
+	_record(IM920_CAPTURE_RX, _captureLine, _captureLength, _captureStart);
+	_captureLength = 0;
+	_captureSeen = false;
+#endif
 }
 
-NoticePacket& NoticePacket::Instance()
+IM920Telemetry::IM920Telemetry(const uint8_t schema[], uint8_t fields)
+	: _schema(schema), _fields(fields), _keyframeInterval(IM920_TELEMETRY_KEYFRAME), _victim(0), _current(nullptr)
 {
-	if (_instance == nullptr) {
-		_instance = new NoticePacket();
+	if (_fields > IM920_TELEMETRY_FIELDS) _fields = IM920_TELEMETRY_FIELDS;
+
+	clear();
+}
+
+IM920Telemetry::~IM920Telemetry()
+{
+}
+
+void IM920Telemetry::setKeyframeInterval(uint8_t interval)
+{
+	_keyframeInterval = interval;
+}
+
+void IM920Telemetry::clear()
+{
+	for (int i = 0; i < IM920_TELEMETRY_PEERS; i++) _peers[i].flags = 0;
+
+	_current = nullptr;
+}
+
+IM920TelemetryPeer* IM920Telemetry::_findPeer(uint16_t moduleID, bool create)
+{
+	for (int i = 0; i < IM920_TELEMETRY_PEERS; i++) {
+		if ((_peers[i].flags & TELEMETRY_PEER_USED) && _peers[i].moduleID == moduleID) return &_peers[i];
 	}
 
-	return *_instance;
+	if (!create) return nullptr;
+
+	// the table is bounded, so a new peer evicts the entries in turn
+	IM920TelemetryPeer* peer = &_peers[_victim];
+	_victim = (_victim + 1) % IM920_TELEMETRY_PEERS;
+
+	peer->moduleID = moduleID;
+	peer->flags = TELEMETRY_PEER_USED;
+	peer->generation = 0;
+	peer->sinceKeyframe = 0;
+
+	return peer;
 }
 
-void NoticePacket::reset(IM920Frame& frame, size_t size) const
+int32_t IM920Telemetry::_narrow(uint8_t field, uint32_t value) const
 {
-	PacketOperator::reset(frame, size);
+	switch (_schema[field])
+	{
+		case IM920_FIELD_INT8:
+			return (int8_t)value;
 
-	setPacketType(frame, IM920_PACKET_NOTICE);
+		case IM920_FIELD_UINT8:
+			return (uint8_t)value;
+
+		case IM920_FIELD_INT16:
+			return (int16_t)value;
+
+		case IM920_FIELD_UINT16:
+			return (uint16_t)value;
+
+		default:
+			return (int32_t)value;
+	}
 }
 
-size_t NoticePacket::getNoticeLength(const IM920Frame& frame) const
+void IM920Telemetry::begin(IM920Frame& frame, uint16_t moduleID)
 {
-	assert(strlen(reinterpret_cast<const char*>(getPayloadArray(frame))) == (getPacketLength(frame)));
+	TelemetryPacket& packet = TelemetryPacket::Instance();
+
+	_current = _findPeer(moduleID, true);
+
+	packet.reset(frame, TELEMETRY_SAMPLE_I);
+
+	uint8_t* buf = packet.getPayloadArray(frame);
+	buf[TELEMETRY_GENERATION_I] = ++_current->generation;
+	buf[TELEMETRY_REFERENCE_I] = _current->referenceGeneration;
+	buf[TELEMETRY_COUNT_I] = 0;
+
+	// without an acknowledged reference, or once in a while, the values are sent in full
+	if (!(_current->flags & TELEMETRY_PEER_REFERENCE) || _current->sinceKeyframe >= _keyframeInterval) {
+		buf[TELEMETRY_COUNT_I] = TELEMETRY_KEYFRAME;
+		_current->sinceKeyframe = 0;
+
+		for (uint8_t i = 0; i < _fields; i++) _previous[i] = 0;
+	} else {
+		_current->sinceKeyframe++;
+
+		for (uint8_t i = 0; i < _fields; i++) _previous[i] = _current->reference[i];
+	}
+
+	// the reference of the next packet is only valid if this one gets acknowledged
+	_current->flags &= ~TELEMETRY_PEER_LATEST;
+
+	packet.updatePacketLength(frame);
+}
+
+bool IM920Telemetry::add(IM920Frame& frame, const int32_t values[])
+{
+	TelemetryPacket& packet = TelemetryPacket::Instance();
+	uint8_t encoded[IM920_TELEMETRY_FIELDS * TELEMETRY_VARINT_MAX];
+	size_t len = 0;
+
+	if (_current == nullptr) return false;
+
+	uint8_t* buf = packet.getPayloadArray(frame);
+	if ((buf[TELEMETRY_COUNT_I] & TELEMETRY_COUNT_MASK) == TELEMETRY_COUNT_MASK) return false;
+
+	for (uint8_t i = 0; i < _fields; i++) {
+		// zigzag keeps small negative deltas short
+		int32_t delta = (int32_t)((uint32_t)values[i] - (uint32_t)_previous[i]);
+		uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+
+		while (zigzag >= 0x80) {
+			encoded[len++] = (uint8_t)zigzag | 0x80;
+			zigzag >>= 7;
+		}
+		encoded[len++] = (uint8_t)zigzag;
+	}
+
+	size_t length = packet.getPacketLength(frame);
+	if (length + len > IM920_PACKET_PAYLOAD_SIZE) return false;
+
+	memcpy(buf + length, encoded, len);
+	buf[TELEMETRY_COUNT_I]++;
+
+	packet.resetPayloadLength(frame, length + len);
+	packet.updatePacketLength(frame);
+
+	// the following samples are deltas against this one
+	for (uint8_t i = 0; i < _fields; i++) {
+		_previous[i] = values[i];
+		_current->latest[i] = values[i];
+	}
+	_current->latestGeneration = buf[TELEMETRY_GENERATION_I];
+	_current->flags |= TELEMETRY_PEER_LATEST;
+
+	return true;
+}
+
+void IM920Telemetry::acknowledge(uint16_t moduleID, uint8_t generation)
+{
+	IM920TelemetryPeer* peer = _findPeer(moduleID, false);
+
+	if (peer == nullptr || !(peer->flags & TELEMETRY_PEER_LATEST)) return;
+	if (peer->latestGeneration != generation) return;
+
+	for (uint8_t i = 0; i < _fields; i++) peer->reference[i] = peer->latest[i];
+	peer->referenceGeneration = generation;
+	peer->flags |= TELEMETRY_PEER_REFERENCE;
+}
+
+int IM920Telemetry::decode(const IM920Frame& frame, int32_t values[], uint8_t maxSamples)
+{
+	TelemetryPacket& packet = TelemetryPacket::Instance();
+	const uint8_t* buf = packet.getPayloadArray(frame);
+	size_t length = packet.getPacketLength(frame);
+
+	if (packet.getPacketType(frame) != IM920_PACKET_TELEMETRY || length < TELEMETRY_SAMPLE_I) return -1;
+
+	IM920TelemetryPeer* peer = _findPeer(frame.getModuleID(), packet.isKeyframe(frame));
+	if (peer == nullptr) return -1;
+
+	if (packet.isKeyframe(frame)) {
+		for (uint8_t i = 0; i < _fields; i++) _previous[i] = 0;
+	} else {
+		uint8_t generation = packet.getReference(frame);
+
+		// the sender moves its reference only to the latest packet it got acknowledged
+		if ((peer->flags & TELEMETRY_PEER_LATEST) && peer->latestGeneration == generation) {
+			for (uint8_t i = 0; i < _fields; i++) peer->reference[i] = peer->latest[i];
+			peer->referenceGeneration = generation;
+			peer->flags |= TELEMETRY_PEER_REFERENCE;
+		}
+
+		if (!(peer->flags & TELEMETRY_PEER_REFERENCE) || peer->referenceGeneration != generation) return -1;
+
+		for (uint8_t i = 0; i < _fields; i++) _previous[i] = peer->reference[i];
+	}
+
+	uint8_t count = packet.getSampleCount(frame);
+	size_t pos = TELEMETRY_SAMPLE_I;
+	int samples = 0;
+
+	for (uint8_t n = 0; n < count; n++) {
+		for (uint8_t i = 0; i < _fields; i++) {
+			uint32_t zigzag = 0;
+			uint8_t shift = 0;
+			uint8_t b;
+
+			do {
+				if (pos >= length || shift > 28) return -1;
+
+				b = buf[pos++];
+				zigzag |= (uint32_t)(b & 0x7F) << shift;
+				shift += 7;
+			} while (b & 0x80);
+
+			uint32_t delta = (zigzag >> 1) ^ (uint32_t)-(int32_t)(zigzag & 1);
+			_previous[i] = _narrow(i, (uint32_t)_previous[i] + delta);
+		}
+
+		if (samples < maxSamples) {
+			memcpy(values + samples * _fields, _previous, _fields * sizeof(int32_t));
+			samples++;
+		}
+	}
+
+	// the last sample may become the reference of a later packet
+	for (uint8_t i = 0; i < _fields; i++) peer->latest[i] = _previous[i];
+	peer->latestGeneration = packet.getGeneration(frame);
+	peer->flags |= TELEMETRY_PEER_LATEST;
 
-	return getPacketLength(frame);
+	return samples;
 }
 
-size_t NoticePacket::getNotice(const IM920Frame& frame, char buf[], size_t size) const
+IM920Bridge::IM920Bridge()
+	: _radio(nullptr), _stream(nullptr), _outLength(0), _outStarted(0), _delay(IM920_BRIDGE_DELAY), _inLength(0), _inPos(0), _inCount(0)
 {
-	const char* notice = reinterpret_cast<const char*>(getPayloadArray(frame));
-	size_t len = getNoticeLength(frame);
-	
-	if (size < len + 1)
-		len = size - 1;
-
-	strncpy(buf, notice, len);
-	buf[len] = '\0';
-
-	return len;
 }
 
-const char* NoticePacket::getNotice(const IM920Frame& frame) const
+IM920Bridge::~IM920Bridge()
 {
-	return reinterpret_cast<const char*>(getPayloadArray(frame));
 }
 
-size_t NoticePacket::setNotice(IM920Frame& frame, const char notice[]) const
+void IM920Bridge::begin(IM920& radio, Stream& stream)
 {
-	size_t noticeLen = strlen(notice);
+	_radio = &radio;
+	_stream = &stream;
 
-	if (noticeLen > NOTICE_MAX_LEN) noticeLen = NOTICE_MAX_LEN;
-	
-	resetPayloadLength(frame, noticeLen);
-	
-	char* buf = reinterpret_cast<char*>(getPayloadArray(frame));
-	strncpy(buf, notice, noticeLen);
-	buf[noticeLen] = '\0';
-	
-	updatePacketLength(frame);
-	
-	return noticeLen;
+	_outLength = 0;
+	_inLength = 0;
+	_inCount = 0;
 }
 
-IM920Frame::IM920Frame()
-	: _p(0), _rp(0)
+void IM920Bridge::setDelay(unsigned long delay)
 {
-	// +1 is for '\0' char
-	for (int i = 0; i < FRAME_PAYLOAD_SIZE + 1; i++) _payload[i] = 0;
+	_delay = delay;
 }
 
-IM920Frame::~IM920Frame()
+uint8_t* IM920Bridge::_beginRecord(size_t length)
 {
-}
+	// a batch is written out as soon as the next record does not fit in
+	if (_outLength > 0 && _outLength + BRIDGE_RECORD_DATA_I + length + 1 > IM920_BRIDGE_BATCH_SIZE) flush();
+
+	if (_outLength == 0) {
+		_out[0] = BRIDGE_MAGIC0;
+		_out[1] = BRIDGE_MAGIC1;
+		_out[BRIDGE_COUNT_I] = 0;
+		_outLength = BRIDGE_RECORD_I;
+		_outStarted = millis();
+	}
 
-size_t IM920Frame::put(uint8_t data)
-{
-	if (!(_p < FRAME_PAYLOAD_SIZE)) return 0;
+	uint8_t* record = _out + _outLength;
+	record[BRIDGE_RECORD_LENGTH_I] = length;
 
-	_payload[_p++] = data;
+	_outLength += BRIDGE_RECORD_DATA_I + length;
+	_out[BRIDGE_COUNT_I]++;
 
-	return _p;
+	return record;
 }
 
-uint8_t IM920Frame::getNextByte()
+bool IM920Bridge::forward(const IM920Frame& frame)
 {
-	if (!(_rp < _p)) return 0;
+	size_t length = frame.getFrameLength();
 
-	return _payload[_rp++];
+	if (_stream == nullptr) return false;
+
+	uint8_t* record = _beginRecord(length);
+	record[BRIDGE_RECORD_NODEID_I] = frame.getNodeID();
+	record[BRIDGE_RECORD_MODULEID_I] = frame.getModuleID() & 0xFF;
+	record[BRIDGE_RECORD_MODULEID_I + 1] = frame.getModuleID() >> 8;
+	record[BRIDGE_RECORD_RSSI_I] = frame.getRSSI();
+	memcpy(record + BRIDGE_RECORD_DATA_I, frame.getArray(), length);
+
+	return true;
 }
 
-void IM920Frame::clear()
+void IM920Bridge::_reject(uint8_t index, uint8_t reason)
 {
-	_p = 0;
-	_rp = 0;
-	for (int i = 0; i < FRAME_PAYLOAD_SIZE + 1; i++) _payload[i] = 0;
+	// an empty record carries the position of the refused record and the reason
+	uint8_t* record = _beginRecord(0);
+	record[BRIDGE_RECORD_NODEID_I] = 0;
+	record[BRIDGE_RECORD_MODULEID_I] = index;
+	record[BRIDGE_RECORD_MODULEID_I + 1] = 0;
+	record[BRIDGE_RECORD_RSSI_I] = reason;
 }
 
-size_t IM920Frame::resetFrameLength(size_t length)
+void IM920Bridge::flush()
 {
-	assert(length <= FRAME_PAYLOAD_SIZE);
+	uint8_t checksum = 0;
 
-	if (length > FRAME_PAYLOAD_SIZE) {
-		_p = FRAME_PAYLOAD_SIZE;
-		return _p;
-	}
-	
-	_p = length;
+	if (_stream == nullptr || _outLength == 0) return;
 
-	if (_p < _rp) _rp = _p;
+	for (uint8_t i = BRIDGE_COUNT_I; i < _outLength; i++) checksum ^= _out[i];
+	_out[_outLength++] = checksum;
 
-	return _p;
+	_stream->write(_out, _outLength);
+	_outLength = 0;
 }
 
-IM920Interface::IM920Interface()
-	: _resetPin(0), _busyPin(0), _activeTime(0), _sleepTime(0), _usTxTimePerByte(0), _initialized(false), _timeout(1000)
+size_t IM920Bridge::_getBatchLength() const
 {
-}
+	size_t pos = BRIDGE_RECORD_I;
 
-IM920Interface::~IM920Interface()
-{
+	if (_inLength < BRIDGE_RECORD_I) return 0;
+
+	for (uint8_t n = 0; n < _in[BRIDGE_COUNT_I]; n++) {
+		if (pos + BRIDGE_RECORD_DATA_I > _inLength) return 0;
+
+		pos += BRIDGE_RECORD_DATA_I + _in[pos + BRIDGE_RECORD_LENGTH_I];
+	}
+
+	// the checksum follows the last record
+	return pos + 1 <= _inLength ? pos + 1 : 0;
 }
 
-void IM920Interface::begin(Stream& serial, int resetPin, int busyPin, long baud)
+void IM920Bridge::_receive()
 {
-	_resetPin = resetPin;
-	_busyPin = busyPin;
-	pinMode(resetPin, OUTPUT);
-	pinMode(busyPin, INPUT);
+	while (_stream->available() > 0)
+	{
+		uint8_t c = _stream->read();
 
-	// release reset signal to enable the interface
-	digitalWrite(resetPin, HIGH);
+		// look for the magic again after a broken batch
+		if ((_inLength == 0 && c != BRIDGE_MAGIC0) || (_inLength == 1 && c != BRIDGE_MAGIC1)) {
+			_inLength = (c == BRIDGE_MAGIC0) ? 1 : 0;
+			_in[0] = c;
 
-	_serial = &serial;
+			continue;
+		}
 
-	_usTxTimePerByte = (1000000 / baud + 1) << 3;
-	
-	_serial->setTimeout(_timeout);
-	
-	// discard the interface start log
-	char buf[32];
-	_serial->readBytesUntil( '\n', buf, sizeof(buf) - 1 );
-	
-	_initialized = true;
-}
+		_in[_inLength++] = c;
 
-void IM920Interface::end()
-{
-	_initialized = false;
+		size_t length = _getBatchLength();
+
+		if (length == 0) {
+			if (_inLength == IM920_BRIDGE_BATCH_SIZE) _inLength = 0;
+
+			continue;
+		}
+
+		uint8_t checksum = 0;
+		for (size_t i = BRIDGE_COUNT_I; i < length; i++) checksum ^= _in[i];
+
+		if (checksum != 0) {
+			_inLength = 0;
+
+			continue;
+		}
+
+		_inPos = BRIDGE_RECORD_I;
+		_inCount = _in[BRIDGE_COUNT_I];
+		if (_inCount == 0) _inLength = 0;
+
+		return;
+	}
 }
 
-size_t IM920Interface::available()
+uint8_t IM920Bridge::_check(const uint8_t* body, size_t length) const
 {
-	return _serial->available();
+	if (length < IM920_PACKET_HEADER_SIZE || length > FRAME_PAYLOAD_SIZE) return IM920_BRIDGE_ERROR_LENGTH;
+
+	if (PacketTypeField::get(body) >= IM920_PACKET_TYPE || PacketVersionField::get(body) > IM920_PACKET_VERSION_2) return IM920_BRIDGE_ERROR_HEADER;
+
+	// the packet header has to describe exactly the bytes the record carries
+	size_t header = _headerLength(body);
+	if (length < header || length - header != PacketLengthField::get(body)) return IM920_BRIDGE_ERROR_LENGTH;
+
+	return 0;
 }
 
-uint8_t IM920Interface::read()
+void IM920Bridge::_dispatch()
 {
-	return _serial->read();
+	IM920Frame frame;
+
+	while (_inCount > 0)
+	{
+		const uint8_t* record = _in + _inPos;
+		size_t length = record[BRIDGE_RECORD_LENGTH_I];
+		uint8_t error = _check(record + BRIDGE_RECORD_DATA_I, length);
+
+		if (error) {
+			_reject(_in[BRIDGE_COUNT_I] - _inCount, error);
+		} else {
+			frame.clear();
+			frame.resetFrameLength(length);
+			memcpy(frame.getArray(), record + BRIDGE_RECORD_DATA_I, length);
+
+			// the rest of the batch stays until the radio has room for it
+			if (_radio->enqueue(frame, IM920TxQueue::getPriority(frame)) < 0) return;
+		}
+
+		_inPos += BRIDGE_RECORD_DATA_I + length;
+		_inCount--;
+	}
+
+	_inLength = 0;
 }
 
-size_t IM920Interface::readBytesUntil(char character, uint8_t buf[], size_t length)
+void IM920Bridge::poll()
 {
-	return _serial->readBytesUntil( character, buf, length );
+	if (_stream == nullptr) return;
+
+	if (_outLength > 0 && millis() - _outStarted >= _delay) flush();
+
+	if (_inCount == 0) _receive();
+
+	if (_inCount > 0) _dispatch();
 }
 
-size_t IM920Interface::sendBytes(const uint8_t* data, size_t length)
+void IM920Storage::erase(unsigned long address, size_t length)
 {
-	size_t ret;
-	char res[5];
+	uint8_t blank[8];
 
-	if (length > FRAME_PAYLOAD_SIZE) length = FRAME_PAYLOAD_SIZE;
-	
-	// send data
-	_serial->print( F("TXDA") );
-	char hexString[FRAME_PAYLOAD_SIZE*2+1];
-	for (int i = 0; i < length; i++) {
-		snprintf(hexString+i*2, 3, "%02X", data[i]);
-		ret = i + 1;
+	memset(blank, 0xFF, sizeof(blank));
+
+	while (length > 0)
+	{
+		size_t n = length < sizeof(blank) ? length : sizeof(blank);
+
+		write(address, blank, n);
+		address += n;
+		length -= n;
 	}
-	_serial->print(hexString);
-	_serial->print(IM920_COMMAND_TERM);
-	_serial->flush();
-	assert(ret == length);
-	
-	_getResponse(res, sizeof(res));
-	
-	if (strncmp(res, IM920_RESPONSE_OK, sizeof(IM920_RESPONSE_OK) - 1) != 0) return 0;
-	
-	return ret;
 }
 
-void IM920Interface::setTimeout(unsigned long timeout)
+IM920Store::IM920Store()
+	: _storage(nullptr), _slots(0), _head(0), _seq(0), _inFlight(IM920_STORE_NONE), _inFlightDestination(0), _reachable(IM920_STORE_REACHABLE)
 {
-	_timeout = timeout;
-	
-	_serial->setTimeout(_timeout);
+	for (int i = 0; i < IM920_STORE_DESTINATIONS; i++) _destinations[i].pending = 0;
 }
 
-int8_t IM920Interface::parseInt8()
+IM920Store::~IM920Store()
 {
-	char a[3];
-	
-	_serial->readBytes(a, 2);
-	a[2] = '\0';
-	
-	return strtoul(a, nullptr, 16);
 }
 
-int16_t IM920Interface::parseInt16()
+uint8_t IM920Store::_readMarker(uint16_t slot)
 {
-	char a[5];
-	
-	_serial->readBytes(a, 4);
-	a[4] = '\0';
-	
-	return strtoul(a, nullptr, 16);
-}
+	uint8_t marker = STORE_FREE;
 
-int32_t IM920Interface::parseInt32()
-{
-	char a[9];
+	_storage->read(_getAddress(slot) + STORE_MARKER_I, &marker, 1);
 
-	_serial->readBytes(a, 8);
-	a[8] = '\0';
-	
-	return strtoul(a, nullptr, 16);
+	return marker;
 }
 
-size_t IM920Interface::execIM920Cmd(const char command[], char response[], size_t length)
+void IM920Store::_writeMarker(uint16_t slot, uint8_t marker)
 {
-	size_t ret;
-	
-	_serial->print(command);
-	_serial->print(F("\r\n"));
-	_serial->flush();
-	
-	ret = _getResponse(response, length);
-	
-	return ret;
+	_storage->write(_getAddress(slot) + STORE_MARKER_I, &marker, 1);
 }
 
-unsigned long IM920Interface::getTxTimePerByte()
+void IM920Store::begin(IM920Storage& storage)
 {
-	return _usTxTimePerByte;
-}
+	uint8_t header[STORE_DATA_I];
+	bool found = false;
 
-int IM920Interface::enableSleep()
-{
-	int ret;
-	
-	ret = _exec("DSRX\r\n", IM920_RESPONSE_OK);
+	_storage = &storage;
+	_slots = storage.size() / IM920_STORE_SLOT_SIZE;
+	_head = 0;
+	_seq = 0;
+	_inFlight = IM920_STORE_NONE;
 
-	return ret;
-}
+	for (int i = 0; i < IM920_STORE_DESTINATIONS; i++) _destinations[i].pending = 0;
 
-int IM920Interface::disableSleep()
-{
-	int ret;
+	// the newest record tells where the log continues after a restart
+	for (uint16_t slot = 0; slot < _slots; slot++) {
+		_storage->read(_getAddress(slot), header, STORE_DATA_I);
 
-	_serial->print(F("?"));
-	_serial->flush();
-	delayMicroseconds(_usTxTimePerByte);
+		if (header[STORE_MARKER_I] == STORE_FREE) continue;
 
-	ret = _exec("ENRX\r\n", IM920_RESPONSE_OK);
+		// a record cut off by a crash was never committed
+		if (header[STORE_MARKER_I] == STORE_WRITING) _writeMarker(slot, STORE_HANDED);
 
-	return ret;
+		uint16_t seq = header[STORE_SEQ_I] | (header[STORE_SEQ_I + 1] << 8);
+
+		if (!found || (int16_t)(seq - _seq) >= 0) {
+			_head = (slot + 1) % _slots;
+			_seq = seq + 1;
+			found = true;
+		}
+	}
+
+	// walk from the oldest slot so that every cursor points to the oldest record
+	for (uint16_t n = 0; n < _slots; n++) {
+		uint16_t slot = (_head + n) % _slots;
+
+		_storage->read(_getAddress(slot), header, STORE_DATA_I);
+
+		if (header[STORE_MARKER_I] != STORE_COMMITTED) continue;
+
+		IM920StoreDestination* destination = _findDestination(header[STORE_MODULEID_I] | (header[STORE_MODULEID_I + 1] << 8), true);
+
+		// records beyond the destination table cannot be tracked
+		if (destination == nullptr) {
+			_writeMarker(slot, STORE_HANDED);
+
+			continue;
+		}
+
+		if (destination->pending++ == 0) destination->cursor = slot;
+	}
 }
 
-uint16_t IM920Interface::getActiveDuration()
+IM920StoreDestination* IM920Store::_findDestination(uint16_t moduleID, bool create)
 {
-	return _activeTime;
+	IM920StoreDestination* empty = nullptr;
+
+	for (int i = 0; i < IM920_STORE_DESTINATIONS; i++) {
+		if (_destinations[i].pending == 0) {
+			if (empty == nullptr) empty = &_destinations[i];
+
+			continue;
+		}
+
+		if (_destinations[i].moduleID == moduleID) return &_destinations[i];
+	}
+
+	if (!create || empty == nullptr) return nullptr;
+
+	empty->moduleID = moduleID;
+	empty->lastHeard = millis() - _reachable;
+
+	return empty;
 }
 
-uint16_t IM920Interface::getSleepDuration()
+bool IM920Store::_isReachable(const IM920StoreDestination& destination) const
 {
-	return _sleepTime;
+	return millis() - destination.lastHeard < _reachable;
 }
 
-void IM920Interface::setActiveDuration(uint16_t activeTime)
+int IM920Store::push(uint16_t moduleID, const IM920Frame& frame)
 {
-	int ret = 0;
-	char cmd[11];
-	
-	if (_activeTime != activeTime) {
-		_activeTime = activeTime;
+	uint8_t header[STORE_DATA_I];
 
-		snprintf(cmd, sizeof(cmd), "SWTM%04X\r\n", _activeTime);
-		ret = _exec(cmd, IM920_RESPONSE_OK);
-	}
-	
-	return ret;
+	if (_storage == nullptr || _slots == 0) return -1;
+
+	// the log never overwrites a record that is not handed to the module yet
+	uint8_t marker = _readMarker(_head);
+	if (marker != STORE_FREE && marker != STORE_HANDED) return -1;
+
+	IM920StoreDestination* destination = _findDestination(moduleID, true);
+	if (destination == nullptr) return -1;
+
+	// the markers of a used slot can only go on once the slot is erased
+	if (marker != STORE_FREE) _storage->erase(_getAddress(_head), IM920_STORE_SLOT_SIZE);
+
+	header[STORE_MARKER_I] = STORE_WRITING;
+	header[STORE_SEQ_I] = _seq & 0xFF;
+	header[STORE_SEQ_I + 1] = _seq >> 8;
+	header[STORE_MODULEID_I] = moduleID & 0xFF;
+	header[STORE_MODULEID_I + 1] = moduleID >> 8;
+	header[STORE_LENGTH_I] = frame.getFrameLength();
+
+	_storage->write(_getAddress(_head), header, STORE_DATA_I);
+	_storage->write(_getAddress(_head) + STORE_DATA_I, frame.getArray(), frame.getFrameLength());
+
+	// the record counts only once the marker says it is complete
+	_writeMarker(_head, STORE_COMMITTED);
+
+	if (destination->pending++ == 0) destination->cursor = _head;
+
+	_head = (_head + 1) % _slots;
+	_seq++;
+
+	return 0;
 }
 
-void IM920Interface::setSleepDuration(uint16_t sleepTime)
+void IM920Store::markReachable(uint16_t moduleID)
 {
-	int ret = 0;
-	char cmd[11];
-	
-	if (_sleepTime != sleepTime) {
-		_sleepTime = sleepTime;
-		
-		snprintf(cmd, sizeof(cmd), "SSTM%04X\r\n", _sleepTime);
-		ret = _exec(cmd, IM920_RESPONSE_OK);
-	}
-	
-	return ret;
+	IM920StoreDestination* destination = _findDestination(moduleID, false);
+
+	if (destination != nullptr) destination->lastHeard = millis();
 }
 
-int IM920Interface::resetInterface()
+void IM920Store::setReachableTime(unsigned long reachable)
 {
-	int ret;
-	
-	ret = _exec("SRST\r\n", "IM920 VER.");
-	
-	return ret;
+	_reachable = reachable;
 }
 
-int IM920Interface::_exec(const char cmd[], const char search[])
+bool IM920Store::peek(IM920Frame& frame)
 {
-	int ret = 0;
-	char buf[20];
-	
-	while(_isBusy());
+	uint8_t header[STORE_DATA_I];
 
-	// send the command
-	_serial->print(cmd);
-	_serial->flush();
-	
-	// check the response
-	_getResponse(buf, sizeof(buf));
-	if (search != nullptr) strcmp(buf, search) == 0 ? ret = 0 : ret = -1;
-	
-	return ret;
+	if (_storage == nullptr || _inFlight != IM920_STORE_NONE) return false;
+
+	for (uint8_t i = 0; i < IM920_STORE_DESTINATIONS; i++) {
+		IM920StoreDestination& destination = _destinations[i];
+
+		if (destination.pending == 0 || !_isReachable(destination)) continue;
+
+		for (uint16_t n = 0; n < _slots; n++) {
+			uint16_t slot = (destination.cursor + n) % _slots;
+
+			_storage->read(_getAddress(slot), header, STORE_DATA_I);
+
+			if (header[STORE_MARKER_I] != STORE_COMMITTED) continue;
+			if ((header[STORE_MODULEID_I] | (header[STORE_MODULEID_I + 1] << 8)) != destination.moduleID) continue;
+
+			frame.clear();
+			frame.resetFrameLength(header[STORE_LENGTH_I]);
+			_storage->read(_getAddress(slot) + STORE_DATA_I, frame.getArray(), frame.getFrameLength());
+
+			destination.cursor = slot;
+			_inFlight = slot;
+			_inFlightDestination = i;
+
+			return true;
+		}
+
+		// the count went out of step with the log
+		destination.pending = 0;
+	}
+
+	return false;
 }
 
-bool IM920Interface::_isBusy()
+void IM920Store::complete(bool accepted)
 {
-	return digitalRead(_busyPin);
+	if (_inFlight == IM920_STORE_NONE) return;
+
+	// the module accepting the frame does not tell whether the destination got it;
+	// a frame the module refused stays in the log and is tried again
+	if (accepted) {
+		IM920StoreDestination& destination = _destinations[_inFlightDestination];
+
+		_writeMarker(_inFlight, STORE_HANDED);
+
+		destination.pending--;
+		destination.cursor = (_inFlight + 1) % _slots;
+	}
+
+	_inFlight = IM920_STORE_NONE;
 }
 
-size_t IM920Interface::_getResponse(char buf[], size_t length)
+size_t IM920Store::getPending(uint16_t moduleID)
 {
-	size_t ret;
+	IM920StoreDestination* destination = _findDestination(moduleID, false);
 
-	_serial->setTimeout(_timeout);
-	ret = _serial->readBytesUntil('\n', buf, length - 1);
-	buf[ret] = '\0';
-	
-	return ret;
+	return destination != nullptr ? destination->pending : 0;
 }
@@ -15,18 +15,224 @@
 
 #include <inttypes.h>
 
+// the receive ring indices are C++11 atomics where the toolchain has them; AVR masks interrupts instead
+#if !defined(IM920_RING_ATOMIC) && !defined(__AVR__) && defined(__has_include)
+	#if __has_include(<atomic>)
+		#define IM920_RING_ATOMIC	1
+	#endif
+#endif
+#ifndef IM920_RING_ATOMIC
+	#define IM920_RING_ATOMIC	0
+#endif
+#if IM920_RING_ATOMIC
+	#include <atomic>
+#endif
+
+#define IM920_PROFILE_TINY		0
+#define IM920_PROFILE_DEFAULT	1
+#define IM920_PROFILE_GATEWAY	2
+
+#ifndef IM920_PROFILE
+	#define IM920_PROFILE	IM920_PROFILE_DEFAULT
+#endif
+
+#if IM920_PROFILE == IM920_PROFILE_TINY
+	#define IM920_PROFILE_TX_QUEUE_SIZE	2
+	#define IM920_PROFILE_WRITE_CHUNK	8
+	#define IM920_PROFILE_HEX_CHUNK		4
+	#define IM920_PROFILE_FEC_GROUP_SIZE	0
+	#define IM920_PROFILE_TELEMETRY_PEERS	1
+	#define IM920_PROFILE_RX_RING_SIZE	0
+	#define IM920_PROFILE_FLOW_CONTROL	0
+	#define IM920_PROFILE_DICTIONARY	0
+	#define IM920_PROFILE_CAPTURE_LINE_SIZE	0
+	#define IM920_PROFILE_RAM_BUDGET	448
+#elif IM920_PROFILE == IM920_PROFILE_GATEWAY
+	#define IM920_PROFILE_TX_QUEUE_SIZE	8
+	#define IM920_PROFILE_WRITE_CHUNK	32
+	#define IM920_PROFILE_HEX_CHUNK		16
+	#define IM920_PROFILE_FEC_GROUP_SIZE	4
+	#define IM920_PROFILE_TELEMETRY_PEERS	8
+	#define IM920_PROFILE_RX_RING_SIZE	256
+	#define IM920_PROFILE_FLOW_CONTROL	1
+	#define IM920_PROFILE_DICTIONARY	1
+	#define IM920_PROFILE_CAPTURE_LINE_SIZE	64
+	#define IM920_PROFILE_RAM_BUDGET	2048
+#else
+	#define IM920_PROFILE_TX_QUEUE_SIZE	4
+	#define IM920_PROFILE_WRITE_CHUNK	16
+	#define IM920_PROFILE_HEX_CHUNK		8
+	#define IM920_PROFILE_FEC_GROUP_SIZE	0
+	#define IM920_PROFILE_TELEMETRY_PEERS	2
+	#define IM920_PROFILE_RX_RING_SIZE	64
+	#define IM920_PROFILE_FLOW_CONTROL	1
+	#define IM920_PROFILE_DICTIONARY	1
+	#define IM920_PROFILE_CAPTURE_LINE_SIZE	16
+	#define IM920_PROFILE_RAM_BUDGET	704
+#endif
+
+#ifndef IM920_TX_QUEUE_SIZE
+	#define IM920_TX_QUEUE_SIZE	IM920_PROFILE_TX_QUEUE_SIZE
+#endif
+#ifndef IM920_WRITE_CHUNK
+	#define IM920_WRITE_CHUNK	IM920_PROFILE_WRITE_CHUNK
+#endif
+#ifndef IM920_HEX_CHUNK
+	#define IM920_HEX_CHUNK		IM920_PROFILE_HEX_CHUNK
+#endif
+#ifndef IM920_FEC_GROUP_SIZE
+	#define IM920_FEC_GROUP_SIZE	IM920_PROFILE_FEC_GROUP_SIZE
+#endif
+#ifndef IM920_TELEMETRY_PEERS
+	#define IM920_TELEMETRY_PEERS	IM920_PROFILE_TELEMETRY_PEERS
+#endif
+#ifndef IM920_RX_RING_SIZE
+	#define IM920_RX_RING_SIZE	IM920_PROFILE_RX_RING_SIZE
+#endif
+#ifndef IM920_FLOW_CONTROL
+	#define IM920_FLOW_CONTROL	IM920_PROFILE_FLOW_CONTROL
+#endif
+#ifndef IM920_DICTIONARY
+	#define IM920_DICTIONARY	IM920_PROFILE_DICTIONARY
+#endif
+#ifndef IM920_CAPTURE_LINE_SIZE
+	#define IM920_CAPTURE_LINE_SIZE	IM920_PROFILE_CAPTURE_LINE_SIZE
+#endif
+#ifndef IM920_RAM_BUDGET
+	#define IM920_RAM_BUDGET	IM920_PROFILE_RAM_BUDGET
+#endif
+
 #define FRAME_PAYLOAD_SIZE	64
 #define IM920_PACKET_HEADER_SIZE	3
+#define IM920_PACKET_HEADER_V2_SIZE	5
+#define IM920_PACKET_VERSION_1	0
+#define IM920_PACKET_VERSION_2	1
+#define IM920_STREAM_NONE	(-1)
 
 #define IM920_PACKET_PAYLOAD_SIZE	(FRAME_PAYLOAD_SIZE - IM920_PACKET_HEADER_SIZE)
+#define IM920_FEC_PAYLOAD_SIZE	(IM920_PACKET_PAYLOAD_SIZE - 2)
+#ifndef IM920_FEC_HOLD_FRAMES
+	#define IM920_FEC_HOLD_FRAMES	4
+#endif
 #define IM920_PACKET_DATA		0
 #define IM920_PACKET_COMMAND	1
 #define IM920_PACKET_ACK		2
 #define IM920_PACKET_NOTICE		3
-#define IM920_PACKET_TYPE		4
+#define IM920_PACKET_PARITY		4
+#define IM920_PACKET_TELEMETRY	5
+#define IM920_PACKET_TYPE		6
 
 #define COMMAND_IM920_CMD	1
 
+#define IM920_AIR_BITRATE_FAST	50000
+#define IM920_AIR_BITRATE_LONG	1250
+#define IM920_AIR_OVERHEAD_BYTES	16
+#define IM920_DUTY_WINDOW	3600000UL
+#define IM920_DUTY_BUDGET	360000UL
+#define IM920_TX_PAUSE	2
+
+#define IM920_FRAGMENT_MIN	8
+#define IM920_MARGINAL_LOSS	0x2000
+
+#define IM920_TX_CONTROL	0
+#define IM920_TX_ACK		1
+#define IM920_TX_NOTICE		2
+#define IM920_TX_BULK		3
+#define IM920_TX_CLASSES	4
+#define IM920_TX_NONE		0xFF
+
+#define IM920_PENDING	(-2)
+#define IM920_DATA_LINE	(-3)
+
+#ifndef IM920_BOOT_TIMEOUT
+	#define IM920_BOOT_TIMEOUT	500
+#endif
+#define IM920_BOOT_SETTLE	10
+#ifndef IM920_BUSY_TIMEOUT
+	#define IM920_BUSY_TIMEOUT	5000
+#endif
+
+#define IM920_TOPIC_SIZE	2
+#define IM920_TOPIC_NONE	0xFFFF
+#define IM920_TOPIC_FILTER_SIZE	8
+
+#define IM920_ACCEPT_MODULE	0x01
+#define IM920_ACCEPT_NODE	0x02
+#define IM920_ACCEPT_TYPE(type)	(1 << (type))
+
+#define IM920_SYNC_TOPIC	"$sync"
+#define IM920_SYNC_DIGITS	8
+#define IM920_SLOT_GUARD	2
+
+#define IM920_FLOW_TOPIC	"$flow"
+#define IM920_FLOW_INITIAL	2
+#define IM920_FLOW_PROBE	500
+#define IM920_FLOW_PROBES	6
+
+#define IM920_FIELD_INT8	0
+#define IM920_FIELD_UINT8	1
+#define IM920_FIELD_INT16	2
+#define IM920_FIELD_UINT16	3
+#define IM920_FIELD_INT32	4
+#define IM920_FIELD_UINT32	5
+#define IM920_TELEMETRY_FIELDS	8
+#define IM920_TELEMETRY_KEYFRAME	16
+
+#ifndef IM920_BRIDGE_BATCH_SIZE
+	#define IM920_BRIDGE_BATCH_SIZE	128
+#endif
+#define IM920_BRIDGE_DELAY	10
+#define IM920_BRIDGE_ERROR_HEADER	1
+#define IM920_BRIDGE_ERROR_LENGTH	2
+
+#ifndef IM920_STORE_DESTINATIONS
+	#define IM920_STORE_DESTINATIONS	4
+#endif
+#define IM920_STORE_SLOT_SIZE	(6 + FRAME_PAYLOAD_SIZE)
+#define IM920_STORE_REACHABLE	5000
+#define IM920_STORE_NONE	0xFFFF
+
+#define IM920_CAPTURE_RX	0x00
+#define IM920_CAPTURE_TX	0x80
+#define IM920_CAPTURE_LENGTH_MASK	0x7F
+#define IM920_CAPTURE_HOLD	10
+
+class IM920Frame;
+
+struct IM920Segment
+{
+	const uint8_t* data;
+
+	size_t length;
+};
+
+typedef void (*IM920ReceiveCallback)(IM920Frame& frame);
+
+typedef void (*IM920SendCallback)(const IM920Frame& frame, int result);
+
+struct IM920Stats
+{
+	unsigned long txFrames;
+
+	unsigned long txErrors;
+
+	unsigned long rxFrames;
+
+	unsigned long rxErrors;
+
+	unsigned long rxFiltered;
+
+	unsigned long rxRecovered;
+
+	unsigned long wakeups;
+
+	unsigned long awakeTime;
+#if IM920_DICTIONARY
+
+	unsigned long txSaved;
+#endif
+};
+
 class IM920Frame
 {
 private:
@@ -40,9 +246,9 @@ private:
 	// +1 is for '\0' character as the termination of payload.
 	uint8_t _payload[FRAME_PAYLOAD_SIZE + 1];
 
-	size_t _p;
+	uint8_t _p;
 
-	size_t _rp;
+	uint8_t _rp;
 
 
 public:
@@ -110,6 +316,10 @@ public:
 
 	size_t getPacketHeaderLength(const IM920Frame& frame) const;
 
+	size_t getMaxPayloadLength(const IM920Frame& frame) const;
+
+	uint8_t getHeaderVersion(const IM920Frame& frame) const;
+
 	size_t getPacketLength(const IM920Frame& frame) const;
 
 	int getPacketType(const IM920Frame& frame) const;
@@ -118,8 +328,14 @@ public:
 
 	bool isAckRequested(const IM920Frame& frame) const;
 
+	bool isCompressed(const IM920Frame& frame) const;
+
 	uint8_t getFrameID(const IM920Frame& frame) const;
 
+	uint16_t getSequence(const IM920Frame& frame) const;
+
+	uint8_t getStreamID(const IM920Frame& frame) const;
+
 	void setPacketLength(IM920Frame& frame, size_t length) const;
 
 	void setPacketType(IM920Frame& frame, uint8_t type) const;
@@ -130,6 +346,10 @@ public:
 
 	void setFrameID(IM920Frame& frame, uint8_t num) const;
 
+	void setSequence(IM920Frame& frame, uint16_t num) const;
+
+	bool setStreamID(IM920Frame& frame, uint8_t stream) const;
+
 	void updatePacketLength(IM920Frame& frame) const;
 
 };
@@ -217,6 +437,32 @@ public:
 
 	size_t setData(IM920Frame& frame, const uint8_t data[], size_t length) const;
 
+	size_t setData(IM920Frame& frame, const IM920Segment segments[], size_t count, size_t offset, size_t length) const;
+
+	uint8_t getFecIndex(const IM920Frame& frame) const;
+
+	void setFecIndex(IM920Frame& frame, uint8_t index) const;
+
+};
+
+class ParityPacket : public PacketOperator
+{
+private:
+	static ParityPacket* _instance;
+
+
+protected:
+	ParityPacket();
+
+	virtual ~ParityPacket();
+
+public:
+	static ParityPacket& Instance();
+
+	void reset(IM920Frame& frame, size_t size=0) const;
+
+	uint8_t getGroupSize(const IM920Frame& frame) const;
+
 };
 
 class NoticePacket : public PacketOperator
@@ -243,7 +489,54 @@ public:
 
 	size_t setNotice(IM920Frame& frame, const char notice[]) const;
 
+	size_t setNotice(IM920Frame& frame, const char topic[], const char notice[]) const;
+
+	bool hasTopic(const IM920Frame& frame) const;
+
+	uint16_t getTopic(const IM920Frame& frame) const;
+
+	const char* getMessage(const IM920Frame& frame) const;
+
+	static uint16_t getTopicHash(const char topic[]);
+
+};
+
+class TelemetryPacket : public PacketOperator
+{
+private:
+	static TelemetryPacket* _instance;
+
+
+protected:
+	TelemetryPacket();
+
+	virtual ~TelemetryPacket();
+
+public:
+	static TelemetryPacket& Instance();
+
+	void reset(IM920Frame& frame, size_t size=0) const;
+
+	uint8_t getGeneration(const IM920Frame& frame) const;
+
+	uint8_t getReference(const IM920Frame& frame) const;
+
+	bool isKeyframe(const IM920Frame& frame) const;
+
+	uint8_t getSampleCount(const IM920Frame& frame) const;
+
+};
+
+#if IM920_DICTIONARY
+class IM920Dictionary
+{
+public:
+	static size_t encode(const uint8_t src[], size_t length, uint8_t dst[], size_t size);
+
+	static int decode(const uint8_t src[], size_t length, uint8_t dst[], size_t size);
+
 };
+#endif
 
 class IM920Interface
 {
@@ -260,16 +553,126 @@ private:
 
 	bool _initialized;
 
+	unsigned long _busySince;
+
 	unsigned long _timeout;
 
 	Stream* _serial;
 
+	Print* _capture;
+
+	unsigned long _captureTime;
+
+#if IM920_CAPTURE_LINE_SIZE > 0
+	// received bytes are held until the line or run ends, stamped with the time the first one was seen
+	uint8_t _captureLine[IM920_CAPTURE_LINE_SIZE];
+
+	uint8_t _captureLength;
+
+	bool _captureSeen;
+
+	unsigned long _captureStart;
+#endif
+
+	uint8_t _op;
+
+	const uint8_t* _txData;
+
+	uint8_t _txLength;
+
+	uint8_t _txPos;
+
+	uint8_t _txMode;
+
+	bool _txChunked;
+
+	uint8_t _responseLen;
+
+	bool _skipLine;
+
+	unsigned long _deadline;
+
+	bool _parseError;
+
+	bool _waking;
+
+	unsigned long _wakeSince;
+
+#if IM920_RX_RING_SIZE > 0
+	// the producer only moves _rxHead and the consumer only moves _rxTail
+	volatile uint8_t _rxRing[IM920_RX_RING_SIZE];
+
+#if IM920_RING_ATOMIC
+	std::atomic<uint16_t> _rxHead;
+
+	std::atomic<uint16_t> _rxTail;
+#else
+	volatile uint16_t _rxHead;
+
+	volatile uint16_t _rxTail;
+#endif
+
+	bool _externalPump;
+#endif
+
 private:
-	int _exec(const char cmd[], const char search[]);
+	int _exec(const char cmd[], const char search[], bool flash = false);
+
+	int _beginLine(const uint8_t data[], size_t length, uint8_t mode);
+
+	bool _writeLine();
+
+	void _fillLine(char buf[], size_t length);
+
+	char _getLineChar(size_t pos) const;
+
+	uint32_t _parseHex(size_t digits);
+
+	size_t _write(const char data[]);
+
+	size_t _write(const char data[], size_t length);
+
+	void _record(uint8_t direction, const uint8_t data[], size_t length, unsigned long time);
+
+	void _recordRx(const uint8_t data[], size_t length);
+
+	void _stampCapture();
+
+#if IM920_CAPTURE_LINE_SIZE > 0
+	void _pollCapture(int count);
+#endif
+
+	void _flushCapture();
 
 	bool _isBusy();
 
-	size_t _getResponse(char buf[], size_t length);
+	int _beginLineWait(const uint8_t data[], size_t length, uint8_t mode);
+
+	void _beginResponse();
+
+	bool _waitReady();
+
+	void _pumpIdle();
+
+	int _available();
+
+	int _readByte();
+
+#if IM920_RX_RING_SIZE > 0
+	size_t _readRun(char buf[], size_t length, int terminator);
+
+	uint16_t _loadHead() const;
+
+	uint16_t _loadTail() const;
+
+	void _storeHead(uint16_t head);
+
+	void _storeTail(uint16_t tail);
+#endif
+
+	size_t _readBytes(char buf[], size_t length);
+
+	size_t _readBytesUntil(char terminator, char buf[], size_t length);
 
 public:
 	IM920Interface();
@@ -288,6 +691,14 @@ public:
 
 	size_t sendBytes(const uint8_t data[], size_t length);
 
+	int beginSendBytes(const uint8_t data[], size_t length);
+
+	int beginCommand(const char command[]);
+
+	int pollResponse(char buf[], size_t length, bool routeData = false);
+
+	bool isPending() const;
+
 	void setTimeout(unsigned long timeout);
 
 	int8_t parseInt8();
@@ -296,14 +707,28 @@ public:
 
 	int32_t parseInt32();
 
+	size_t readHexList(uint8_t buf[], size_t count);
+
+	bool checkParseError();
+
+	static size_t decodeHexList(const char src[], size_t count, uint8_t dst[]);
+
 	size_t execIM920Cmd(const char command[], char response[], size_t length);
 
+	int configure(const char* const commands[], size_t count);
+
 	unsigned long getTxTimePerByte();
 
+	unsigned long getBusyTime();
+
 	int enableSleep();
 
 	int disableSleep();
 
+	int beginSleep();
+
+	int beginWakeUp();
+
 	uint16_t getActiveDuration();
 
 	uint16_t getSleepDuration();
@@ -314,6 +739,329 @@ public:
 
 	int resetInterface();
 
+	void setCapture(Print* capture);
+
+#if IM920_RX_RING_SIZE > 0
+	void pump();
+
+	void setExternalPump(bool external);
+#endif
+
+};
+
+class IM920RateLimiter
+{
+private:
+	unsigned long _bitRate;
+
+	unsigned long _window;
+
+	unsigned long _refill;
+
+	unsigned long _capacity;
+
+	unsigned long _tokens;
+
+	unsigned long _pause;
+
+	unsigned long _previous;
+
+	unsigned long _next;
+
+private:
+	void _update();
+
+public:
+	IM920RateLimiter();
+
+	~IM920RateLimiter();
+
+	void setBitRate(unsigned long bitRate);
+
+	void setDutyLimit(unsigned long window, unsigned long budget);
+
+	void setPause(unsigned long pause);
+
+	unsigned long getAirTime(size_t length) const;
+
+	unsigned long getWaitTime(size_t length);
+
+	void consume(size_t length);
+
+};
+
+class IM920TimeSync
+{
+private:
+	unsigned long _interval;
+
+	unsigned long _lastBeacon;
+
+	bool _synchronized;
+
+	unsigned long _baseLocal;
+
+	long _baseOffset;
+
+	long _drift;
+
+	uint8_t _slot;
+
+	uint8_t _slotCount;
+
+	uint16_t _slotLength;
+
+public:
+	IM920TimeSync();
+
+	~IM920TimeSync();
+
+	void setMaster(unsigned long interval);
+
+	bool isMaster() const { return _interval > 0; };
+
+	bool isSynchronized() const { return _synchronized; };
+
+	void update(unsigned long remote, unsigned long local);
+
+	unsigned long now() const;
+
+	long getDrift() const { return _drift; };
+
+	bool pollBeacon();
+
+	void setSlot(uint8_t slot, uint8_t slotCount, uint16_t slotLength);
+
+	unsigned long getSlotWait(unsigned long airTime) const;
+
+	bool fitsSlot(unsigned long airTime) const;
+
+};
+
+class IM920LinkEstimator
+{
+private:
+	uint16_t _loss;
+
+	uint8_t _length;
+
+	uint8_t _rssi;
+
+	uint8_t _marginalRSSI;
+
+public:
+	IM920LinkEstimator();
+
+	~IM920LinkEstimator();
+
+	void update(size_t frameLength, bool lost);
+
+	void updateRSSI(uint8_t rssi);
+
+	void setMarginalRSSI(uint8_t rssi);
+
+	uint16_t getLossRate() const { return _loss; };
+
+	uint8_t getRSSI() const { return _rssi; };
+
+	size_t getFragmentSize() const;
+
+};
+
+struct IM920TelemetryPeer
+{
+	uint16_t moduleID;
+
+	uint8_t flags;
+
+	uint8_t generation;
+
+	uint8_t latestGeneration;
+
+	uint8_t referenceGeneration;
+
+	uint8_t sinceKeyframe;
+
+	int32_t latest[IM920_TELEMETRY_FIELDS];
+
+	int32_t reference[IM920_TELEMETRY_FIELDS];
+};
+
+class IM920Telemetry
+{
+private:
+	const uint8_t* _schema;
+
+	uint8_t _fields;
+
+	uint8_t _keyframeInterval;
+
+	IM920TelemetryPeer _peers[IM920_TELEMETRY_PEERS];
+
+	uint8_t _victim;
+
+	IM920TelemetryPeer* _current;
+
+	int32_t _previous[IM920_TELEMETRY_FIELDS];
+
+	IM920TelemetryPeer* _findPeer(uint16_t moduleID, bool create);
+
+	int32_t _narrow(uint8_t field, uint32_t value) const;
+
+public:
+	IM920Telemetry(const uint8_t schema[], uint8_t fields);
+
+	~IM920Telemetry();
+
+	void setKeyframeInterval(uint8_t interval);
+
+	void begin(IM920Frame& frame, uint16_t moduleID);
+
+	bool add(IM920Frame& frame, const int32_t values[]);
+
+	void acknowledge(uint16_t moduleID, uint8_t generation);
+
+	int decode(const IM920Frame& frame, int32_t values[], uint8_t maxSamples);
+
+	void clear();
+
+};
+
+class IM920Storage
+{
+public:
+	virtual ~IM920Storage() {};
+
+	virtual size_t read(unsigned long address, uint8_t buf[], size_t length) = 0;
+
+	virtual size_t write(unsigned long address, const uint8_t data[], size_t length) = 0;
+
+	virtual void erase(unsigned long address, size_t length);
+
+	virtual unsigned long size() const = 0;
+
+};
+
+struct IM920StoreDestination
+{
+	uint16_t moduleID;
+
+	uint16_t cursor;
+
+	uint16_t pending;
+
+	unsigned long lastHeard;
+};
+
+class IM920Store
+{
+private:
+	IM920Storage* _storage;
+
+	uint16_t _slots;
+
+	uint16_t _head;
+
+	uint16_t _seq;
+
+	uint16_t _inFlight;
+
+	uint8_t _inFlightDestination;
+
+	unsigned long _reachable;
+
+	IM920StoreDestination _destinations[IM920_STORE_DESTINATIONS];
+
+private:
+	unsigned long _getAddress(uint16_t slot) const { return (unsigned long)slot * IM920_STORE_SLOT_SIZE; };
+
+	uint8_t _readMarker(uint16_t slot);
+
+	void _writeMarker(uint16_t slot, uint8_t marker);
+
+	IM920StoreDestination* _findDestination(uint16_t moduleID, bool create);
+
+	bool _isReachable(const IM920StoreDestination& destination) const;
+
+public:
+	IM920Store();
+
+	~IM920Store();
+
+	void begin(IM920Storage& storage);
+
+	int push(uint16_t moduleID, const IM920Frame& frame);
+
+	void markReachable(uint16_t moduleID);
+
+	void setReachableTime(unsigned long reachable);
+
+	bool peek(IM920Frame& frame);
+
+	void complete(bool accepted);
+
+	size_t getPending(uint16_t moduleID);
+
+};
+
+class IM920TxQueue
+{
+private:
+	IM920Frame _frames[IM920_TX_QUEUE_SIZE];
+
+	uint8_t _used;
+
+	uint8_t _fifo[IM920_TX_CLASSES][IM920_TX_QUEUE_SIZE];
+
+	uint8_t _head[IM920_TX_CLASSES];
+
+	uint8_t _count[IM920_TX_CLASSES];
+
+	uint8_t _weight[IM920_TX_CLASSES];
+
+	uint8_t _credit[IM920_TX_CLASSES];
+
+	// frames committed while marking is on belong to a blocking sender
+	uint8_t _marked;
+
+	bool _marking;
+
+private:
+	uint8_t _select();
+
+public:
+	IM920TxQueue();
+
+	~IM920TxQueue();
+
+	IM920Frame* reserve();
+
+	void commit(IM920Frame* frame, uint8_t priority);
+
+	IM920Frame* peek();
+
+	IM920Frame* take();
+
+	void release(IM920Frame* frame);
+
+	size_t count(uint8_t priority) const;
+
+	bool isEmpty() const { return _used == 0; };
+
+	bool isFull() const;
+
+	bool setMarking(bool marking);
+
+	bool isMarked(const IM920Frame* frame) const;
+
+	bool hasMarked() const { return _marked != 0; };
+
+	size_t getFreeCount() const;
+
+	void setWeight(uint8_t priority, uint8_t weight);
+
+	static uint8_t getPriority(const IM920Frame& frame);
+
 };
 
 class IM920
@@ -321,28 +1069,206 @@ class IM920
 private:
 	IM920Interface _im920;
 
+	IM920RateLimiter _limiter;
+
+	IM920TxQueue _txQueue;
+
+	bool _markedFailed;
+
+	IM920LinkEstimator _link;
+
+	bool _adaptiveFragment;
+
+	uint16_t _frameID;
+
+	int16_t _stream;
+
+	IM920Frame* _txFrame;
+
+	char _txResponse[5];
+
+	IM920Frame _rxFrame;
+
+	uint8_t _rxState;
+
+	unsigned long _rxStarted;
+
+	unsigned long _rxProgress;
+
+	int _rxAvailable;
+
+	uint8_t _exec;
+
+	IM920ReceiveCallback _onReceive;
+
+	IM920SendCallback _onSent;
+
+	IM920Stats _stats;
+
+	uint8_t _topicFilter[IM920_TOPIC_FILTER_SIZE];
+
+	bool _topicFiltering;
+
+	uint8_t _acceptFlags;
+
+	uint16_t _acceptModuleID;
+
+	uint8_t _acceptNodeID;
+
+	uint8_t _acceptTypes;
+
+	uint8_t _acceptRSSI;
+
+	IM920TimeSync* _timeSync;
+
+	IM920Store* _store;
+
+	IM920Frame* _storeFrame;
+
+	uint16_t _sleepLinger;
+
+	uint8_t _power;
+
+	unsigned long _powerSince;
+
+	unsigned long _powerIdle;
+
+#if IM920_FLOW_CONTROL
+	uint16_t _flowPeer;
+
+	uint8_t _flowWindow;
+
+	uint8_t _flowLastID;
+
+	uint8_t _flowAdvertised;
+
+	uint8_t _flowLimit;
+
+	uint8_t _flowState;
+
+	uint8_t _flowProbes;
+
+	unsigned long _flowHeard;
+#endif
+
+#if IM920_DICTIONARY
+	bool _compress;
+#endif
+
+#if IM920_FEC_GROUP_SIZE > 0
+	uint8_t _fecSize;
+
+	uint8_t _fecCount;
+
+	uint8_t _fecLength;
+
+	uint8_t _fecMaxLength;
+
+	bool _fecPending;
+
+	uint8_t _fecParity[IM920_FEC_PAYLOAD_SIZE];
+
+	IM920Frame _fecFrames[IM920_FEC_GROUP_SIZE];
+
+	uint8_t _fecMask;
+
+	uint8_t _fecNext;
+
+	uint8_t _fecEnd;
+
+	uint16_t _fecModule;
+
+	unsigned long _fecHeld;
+#endif
+
 private:
-	IM920() {};
+	int _flush();
 
-	~IM920() { _im920.end(); };
+	void _pollTx();
+
+	void _pollRx();
+
+	bool _isAccepted() const;
+
+	void _completeReceive();
+
+	void _deliver();
+
+	bool _isBeacon(const IM920Frame& frame);
+
+	void _stampBeacon(IM920Frame& frame);
+
+	void _receiveBeacon();
+
+#if IM920_FLOW_CONTROL
+	bool _isFlowNotice(const IM920Frame& frame);
 
-	uint8_t _getNextFrameID();
+	void _receiveFlow();
 
-	size_t _send(IM920Frame& frame);
+	void _pollFlow();
+
+	uint8_t _getFlowWindow();
+#endif
+
+#if IM920_FEC_GROUP_SIZE > 0
+	void _protect(IM920Frame& frame);
+
+	bool _enqueueParity();
+
+	bool _holdProtected();
+
+	void _recoverProtected();
+
+	void _expireProtected();
+
+	bool _releaseProtected();
+
+	void _resetProtected();
+
+	bool _isProtecting() const;
+#endif
+
+	void _completeSend(int ret);
+
+	void _completeExec(int ret);
+
+	void _accountAwake();
+
+	void _completePower(int ret);
+
+	bool _pollPower();
+
+	void _replyExec();
+
+	void _failHead();
+
+#if IM920_DICTIONARY
+	void _compressFrame(IM920Frame& frame);
+
+	bool _expandFrame(IM920Frame& frame);
+#endif
 
 public:
+	IM920();
+
+	~IM920() { _im920.end(); };
+
 	static IM920& Instance();
 
 	void begin(Stream& serial, int resetPin, int busyPin, long baud) { _im920.begin(serial, resetPin, busyPin, baud); };
 
 	void end() { _im920.end(); };
 
+	void poll();
+
 	int listen(IM920Frame& frame, long timeout);
 
 	int send(IM920Frame& frame);
 
 	size_t sendData(const uint8_t data[], size_t length, bool fragment);
 
+	size_t sendDataV(const IM920Segment segments[], size_t count, bool fragment);
+
 	int sendCommand(uint8_t cmd, const char param[]);
 
 	int sendCommandWithAck(uint8_t cmd, const char param[]);
@@ -351,7 +1277,140 @@ public:
 
 	int sendNotice(const char notice[]);
 
+	int publish(const char topic[], const char message[]);
+
+	void subscribe(const char topic[]);
+
+	void clearSubscriptions();
+
+	bool isSubscribed(uint16_t topic) const;
+
+	void setAcceptModule(uint16_t moduleID);
+
+	void setAcceptNode(uint8_t nodeID);
+
+	void setAcceptTypes(uint8_t typeMask);
+
+	void setMinimumRSSI(uint8_t rssi);
+
+	void clearAcceptFilter();
+
+	void setAdaptiveFragment(bool adaptive) { _adaptiveFragment = adaptive; };
+
+	void reportDelivery(size_t frameLength, bool lost);
+
+	IM920LinkEstimator& getLinkEstimator() { return _link; };
+
+#if IM920_FEC_GROUP_SIZE > 0
+	void setFec(uint8_t groupSize);
+#endif
+
+	int enqueue(const IM920Frame& frame, uint8_t priority);
+
+	size_t enqueueData(const uint8_t data[], size_t length, bool fragment);
+
+	size_t enqueueDataV(const IM920Segment segments[], size_t count, size_t offset, bool fragment);
+
+	void setStream(int stream);
+
+	void setReceiveCallback(IM920ReceiveCallback callback) { _onReceive = callback; };
+
+	void setSendCallback(IM920SendCallback callback) { _onSent = callback; };
+
+	const IM920Stats& getStats();
+
 	IM920Interface& getInterface();
+
+	IM920RateLimiter& getRateLimiter();
+
+	void setTimeSync(IM920TimeSync* timeSync);
+
+	void setStore(IM920Store* store);
+
+	void setAutoSleep(uint16_t linger);
+
+	bool isAwake() const;
+
+#if IM920_DICTIONARY
+	void setCompression(bool enable);
+#endif
+
+#if IM920_FLOW_CONTROL
+	void setFlowControl(uint16_t moduleID, uint8_t window);
+
+	bool isFlowStalled() const;
+#endif
+
+	void setTxWeight(uint8_t priority, uint8_t weight) { _txQueue.setWeight(priority, weight); };
 };
 
+class IM920Bridge
+{
+private:
+	IM920* _radio;
+
+	Stream* _stream;
+
+	uint8_t _out[IM920_BRIDGE_BATCH_SIZE];
+
+	uint8_t _outLength;
+
+	unsigned long _outStarted;
+
+	unsigned long _delay;
+
+	uint8_t _in[IM920_BRIDGE_BATCH_SIZE];
+
+	uint8_t _inLength;
+
+	uint8_t _inPos;
+
+	uint8_t _inCount;
+
+private:
+	uint8_t* _beginRecord(size_t length);
+
+	size_t _getBatchLength() const;
+
+	uint8_t _check(const uint8_t* body, size_t length) const;
+
+	void _reject(uint8_t index, uint8_t reason);
+
+	void _receive();
+
+	void _dispatch();
+
+public:
+	IM920Bridge();
+
+	~IM920Bridge();
+
+	void begin(IM920& radio, Stream& stream);
+
+	void setDelay(unsigned long delay);
+
+	bool forward(const IM920Frame& frame);
+
+	void flush();
+
+	void poll();
+
+};
+
+static_assert(IM920_TX_QUEUE_SIZE > 0 && IM920_TX_QUEUE_SIZE <= 8, "IM920_TX_QUEUE_SIZE must be 1 to 8");
+
+static_assert(IM920_BRIDGE_BATCH_SIZE >= 8 + FRAME_PAYLOAD_SIZE && IM920_BRIDGE_BATCH_SIZE <= 255, "IM920_BRIDGE_BATCH_SIZE must hold one frame and fit in a byte");
+
+static_assert((IM920_RX_RING_SIZE & (IM920_RX_RING_SIZE - 1)) == 0 && IM920_RX_RING_SIZE <= 32768, "IM920_RX_RING_SIZE must be 0 or a power of two up to 32768");
+
+static_assert(IM920_FLOW_INITIAL < 128, "IM920_FLOW_INITIAL must be below 128");
+
+static_assert(IM920_FEC_GROUP_SIZE <= 7, "IM920_FEC_GROUP_SIZE must be 0 to 7");
+
+static_assert(IM920_CAPTURE_LINE_SIZE <= IM920_CAPTURE_LENGTH_MASK, "IM920_CAPTURE_LINE_SIZE must fit in one capture record");
+
+#if defined(__AVR__)
+static_assert(sizeof(IM920) <= IM920_RAM_BUDGET, "IM920 exceeds the RAM budget of the selected profile");
+#endif
+
 #endif /* IM920_H */